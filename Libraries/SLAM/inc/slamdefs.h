@@ -32,6 +32,40 @@
 #define MAP_NAVRESOLUTION_FAC	3 //Resolution of navigation cells in MAP_RESOLUTION_MM * MAP_NAVRESOLUTION_FAC mm (on each navresolution cell there come MAP_NAVRESOLUTION_FAC^2 MAP_SIZE_X_MM / MAP_RESOLUTION_MM cells)
 #define MAP_NAV_SIZE_X_PX		MAP_SIZE_X_MM / (MAP_RESOLUTION_MM * MAP_NAVRESOLUTION_FAC)
 #define MAP_NAV_SIZE_Y_PX		MAP_SIZE_Y_MM / (MAP_RESOLUTION_MM * MAP_NAVRESOLUTION_FAC)
+#define MAP_SIZE_X_PX			(MAP_SIZE_X_MM / MAP_RESOLUTION_MM)
+#define MAP_SIZE_Y_PX			(MAP_SIZE_Y_MM / MAP_RESOLUTION_MM)
+
+//Tiles: The map is divided into tiles of MAP_TILE_SIZE_PX * MAP_TILE_SIZE_PX pixels. Every tile has flags
+//that mark it as changed (dirty), so that everything depending on the map only has to process the changed regions.
+#define MAP_TILE_SIZE_PX		10
+#define MAP_TILES_X				(MAP_SIZE_X_PX / MAP_TILE_SIZE_PX)
+#define MAP_TILES_Y				(MAP_SIZE_Y_PX / MAP_TILE_SIZE_PX)
+
+#define MAP_TILE_DIRTY_DISTMAP	0x01 //A pixel of the tile crossed MAP_OBSTACLE_THRESHOLD -> distance map has to be recalculated
+#define MAP_TILE_DIRTY_LCD		0x02 //Tile changed since the last time the map was drawn on the display
+#define MAP_TILE_DIRTY_PCUI		0x04 //Tile changed since the last time it was sent to the PC (pcui_sendMap)
+#define MAP_TILE_DIRTY_ALL		(MAP_TILE_DIRTY_DISTMAP | MAP_TILE_DIRTY_LCD | MAP_TILE_DIRTY_PCUI)
+
+//Decay: The obstacles in tiles no laser ray passed through for MAP_DECAY_AGE scans are slowly pulled back
+//to unknown (127), so that obstacles that are gone (people walking by...) do not stay in the map forever.
+#define MAP_DECAY_AGE				25 //Scans (~5s) without confirmation until a tile decays (has to be < 255 - MAP_TILES_X * MAP_TILES_Y / MAP_DECAY_TILES_PER_UPDATE)
+#define MAP_DECAY_SHIFT				3 //Every decay step pulls a pixel by 1/2^MAP_DECAY_SHIFT of its distance towards 127
+#define MAP_DECAY_TILES_PER_UPDATE	30 //Tiles processed per call of slam_map_decay (-> whole map in 30 scans)
+
+#define MAP_OBSTACLE_THRESHOLD	160 //Map pixel with a value >= this are treated as obstacle (e.g. by the distance map)
+
+//Distance map (likelihood field): Distance of every pixel to the next obstacle, clamped to MAP_DISTMAP_MAX.
+//Needs MAP_DISTMAP_SIZE_X_PX * MAP_DISTMAP_SIZE_Y_PX bytes (22.5kB) of additional RAM, therefore it is optional.
+#ifndef SLAM_USE_DISTMAP
+	#define SLAM_USE_DISTMAP	0
+#endif
+#define MAP_DISTMAP_FAC			2 //Resolution of the distance map in MAP_RESOLUTION_MM * MAP_DISTMAP_FAC mm (MAP_TILE_SIZE_PX has to be a multiple of it!)
+#define MAP_DISTMAP_SIZE_X_PX	(MAP_SIZE_X_PX / MAP_DISTMAP_FAC)
+#define MAP_DISTMAP_SIZE_Y_PX	(MAP_SIZE_Y_PX / MAP_DISTMAP_FAC)
+#define MAP_DISTMAP_STEP		30 //Distance between two neighbouring distance map pixels (chamfer distance)
+#define MAP_DISTMAP_STEP_DIAG	42 //Distance between two diagonal neighbouring pixels (~MAP_DISTMAP_STEP * sqrt(2))
+#define MAP_DISTMAP_MAX			255 //Clamping value (-> ~8 pixels or 340mm)
+#define MAP_DISTMAP_TILES_PER_UPDATE	60 //Maximum amount of dirty tiles recalculated per call of slam_distmap_update (the rest is done in the next call)
 
 #define MAP_VAR_MAX			255 //Overflow of map pixel
 #define MAP_VAR_MIN			0 //Underflow of map pixel
@@ -39,6 +73,48 @@
 #define IS_OBSTACLE			255 //Obstacle with 100% certainty
 #define NO_OBSTACLE			0 //Obstacle with 0% certainty
 
+#define SLAM_HOLE_WIDTH_MAP		350 //hole_width of the raw map in mm (see slam_map_update)
+#define SLAM_HOLE_WIDTH_NAV		500 //hole_width of the navigation map in mm
+#define SLAM_RAYPROFILE_LEN		32 //Amount of precomputed hole profiles (for derrorv = 0..SLAM_RAYPROFILE_LEN-1 pixels, see slam_laserRayToMap). Longer ones are calculated.
+
+#define SLAM_MATCH_SCORE_MAX	(255 * 1024) //Result of slam_distanceScanToMap if all rays end on obstacles
+
+#define SLAM_STRENGTH_MIN		16 //Rays with a weaker signal strength are dropped (0: use all rays)
+#define SLAM_STRENGTH_FULL		256 //Rays with at least this signal strength get the full weight
+#define SLAM_WEIGHT_FULL		16 //Weight of a ray with full signal strength (see slam_scan_t)
+
+//Scan filter (see slam_filter.c). Default configuration, can be changed at runtime in slam->filter.
+#define SLAM_FILTER_RANGE_MAX		5000 //Range clipping: Longer rays are dropped (XV-11: specified up to 6m, noisy at the end)
+#define SLAM_FILTER_BODY_CM			12 //Robot body mask: Rays shorter than this (cm) hit the robot itself or the lidar cover
+#define SLAM_FILTER_MEDIAN_K		3 //Width of the angular median (odd, 1: off)
+#define SLAM_FILTER_MEDIAN_MAX		7 //Maximum width of the median
+#define SLAM_FILTER_ISOLATED_MM		100 //A ray is isolated (dropped) if no neighbouring ray is closer than SLAM_FILTER_ISOLATED_MM + dist >> SLAM_FILTER_ISOLATED_SHIFT...
+#define SLAM_FILTER_ISOLATED_SHIFT	4 //...(rays on walls in a grazing angle get further apart with the distance)
+#define SLAM_FILTER_RING			8 //Size of the ring buffers between the stages (power of 2, > SLAM_FILTER_MEDIAN_MAX)
+
+//Stages of the scan filter
+enum SLAM_FILTER {
+	SLAM_FILTER_CLIP, //Range clipping and robot body mask
+	SLAM_FILTER_MEDIAN, //Angular median
+	SLAM_FILTER_ISOLATED, //Isolated point rejection
+	SLAM_FILTER_STAGES
+};
+
+//Map integration policy (see slam_map_integrationPolicy)
+#define SLAM_MAPINT_SCORE_MIN			(SLAM_MATCH_SCORE_MAX * 40 / 100) //Scans matching worse than this are not integrated (the position is probably wrong and would smear the map)
+#define SLAM_MAPINT_SCORE_PARTIAL		(SLAM_MATCH_SCORE_MAX * 60 / 100) //Scans matching worse than this are only integrated partially
+#define SLAM_MAPINT_MOVE_MIN_MM			50 //If the robot moved less than this...
+#define SLAM_MAPINT_TURN_MIN			5 //...and turned less than this (degree) since the last integration, the scan is redundant and skipped
+#define SLAM_MAPINT_TURNRATE_PARTIAL	45 //Above this turning rate (degree/s) the scan is distorted and only integrated partially
+#define SLAM_MAPINT_STRIDE_PARTIAL		3 //Partial integration: Only every x-th ray
+#define SLAM_MAPINT_SKIP_MAX			10 //Redundant scans are integrated anyway after x skipped ones (moving obstacles etc.)
+
+//Matching mode of slam_distanceScanToMap
+enum SLAM_MATCH {
+	SLAM_MATCH_RAW, //Sum of the raw map pixels at the end of the rays
+	SLAM_MATCH_DISTMAP //Sum of the inverted distances of the ray ends to the next obstacle (smooth, needs SLAM_USE_DISTMAP)
+};
+
 //Coordinates: location in room (x, y, z)
 typedef struct {
 	float x;
@@ -52,6 +128,34 @@ typedef struct {
 	float psi;
 } slam_position_t;
 
+//Laserscan in cartesian coordinates (in mm, robot frame at the end of the scan, same axes as
+//lidar_x = dist * sin(i), lidar_y = dist * cos(i)). Rays without data: x = y = 0.
+typedef struct {
+	int16_t x[LASERSCAN_POINTS];
+	int16_t y[LASERSCAN_POINTS];
+	u_int8_t w[LASERSCAN_POINTS]; //Weight of the ray (1...SLAM_WEIGHT_FULL) from the signal strength, used for matching and the map update
+} slam_scan_t;
+
+//Scan filter: Configuration, state of the current scan (the rays are pushed in the order they are measured
+//and come out delayed by the reach of the median and the isolated point rejection) and statistics.
+typedef struct {
+	u_int8_t enabled; //(1 << SLAM_FILTER_...) of the active stages
+	int16_t range_max; //Range clipping (mm)
+	u_int8_t body[LASERSCAN_POINTS]; //Robot body mask: Rays shorter than body[i] (cm) are dropped
+	u_int8_t median_k; //Width of the median (odd, 1...SLAM_FILTER_MEDIAN_MAX)
+	int16_t isolated_mm; //See SLAM_FILTER_ISOLATED_MM
+
+	int16_t first; //Index of the first ray of the scan
+	int16_t n_in; //Rays pushed
+	int16_t n_med; //Rays through the median
+	int16_t n_out; //Rays completely filtered (written into sensordata.lidar)
+	int16_t clip[SLAM_FILTER_RING]; //Output of the clipping (ring buffer, index: ray & (SLAM_FILTER_RING - 1))
+	int16_t med[SLAM_FILTER_RING]; //Output of the median
+
+	u_int32_t cycles[SLAM_FILTER_STAGES]; //DWT cycles spent in every stage (current scan)
+	u_int16_t dropped[SLAM_FILTER_STAGES]; //Rays dropped by every stage (current scan)
+} slam_filter_t;
+
 //Datastruct: (Pointer to) all relevant sensor/hardware information of the robot
 typedef struct {
 	int32_t *odo_l; //Odometer left
@@ -59,31 +163,65 @@ typedef struct {
 	int32_t odo_l_old; //Last odometer value after call of slam_processMovement
 	int32_t odo_r_old;	//"
 	int16_t lidar[LASERSCAN_POINTS]; //Laserscan data
+	u_int16_t strength[LASERSCAN_POINTS]; //Signal strength of the laserscan data
+	slam_scan_t scan; //Laserscan data in cartesian coordinates, corrected by the movement during the scan (used for matching and the map update)
 } slam_sensordata_t;
 
 typedef u_int8_t slam_map_pixel_t;
 typedef u_int8_t slam_map_navpixel_t;
+typedef u_int8_t slam_map_distpixel_t;
 
 //Raw Map
 typedef struct {
 	slam_map_pixel_t px[MAP_SIZE_X_MM / MAP_RESOLUTION_MM][MAP_SIZE_Y_MM / MAP_RESOLUTION_MM][MAP_SIZE_Z_LAYERS];
 	slam_map_navpixel_t nav[MAP_NAV_SIZE_X_PX][MAP_NAV_SIZE_X_PX][MAP_SIZE_Z_LAYERS];
+#if SLAM_USE_DISTMAP
+	slam_map_distpixel_t dist[MAP_DISTMAP_SIZE_X_PX][MAP_DISTMAP_SIZE_Y_PX][MAP_SIZE_Z_LAYERS];
+#endif
+	u_int8_t tile_flags[MAP_TILES_X * MAP_TILES_Y]; //MAP_TILE_DIRTY_... flags of every tile
+	u_int16_t distmap_cursor; //Tile where slam_distmap_update continues
+	u_int8_t tile_seen[MAP_TILES_X * MAP_TILES_Y]; //Value of decay_cycle when a laser ray passed through the tile the last time
+	u_int8_t decay_cycle; //Incremented with every call of slam_map_decay
+	u_int16_t decay_cursor; //Tile where slam_map_decay continues
 } slam_map_t;
 
+//Precomputed tables for the integration of the laser rays into the map (see slam_rayprofile_init)
+typedef struct {
+	float ray_sin[LASERSCAN_POINTS]; //sin and cos of the angle of every laser ray
+	float ray_cos[LASERSCAN_POINTS];
+	int16_t value; //The hole profile was calculated for this value
+	int16_t incv[SLAM_RAYPROFILE_LEN]; //Increment of the pixel value per pixel in the hole, for every half hole length (derrorv) in pixels
+	int16_t incerrorv[SLAM_RAYPROFILE_LEN]; //Remainder of that increment (Bresenham error)
+} slam_rayprofile_t;
+
+//State of the map integration policy
+typedef struct {
+	slam_position_t pos_integrated; //Position of the last integrated scan
+	slam_position_t pos_last; //Position of the last scan (for the turning rate)
+	u_int8_t skipped; //Amount of redundant scans skipped since the last integration
+	u_int8_t integrated; //0 until the first scan was integrated
+} slam_mapint_t;
+
 //Container of all SLAM information:
 typedef struct {
 	slam_position_t robot_pos;
 	slam_sensordata_t sensordata;
 	slam_map_t map;
+	slam_rayprofile_t rayprofile;
+	slam_mapint_t mapint;
+	slam_filter_t filter;
+	u_int8_t matchmode; //SLAM_MATCH_...
 } slam_t;
 
-extern int16_t slam_monteCarloSearch(slam_t *slam, int16_t sigma_xy, int16_t sigma_psi, uint16_t stop);
+extern int32_t slam_monteCarloSearch(slam_t *slam, int16_t sigma_xy, int16_t sigma_psi, uint16_t stop);
 
 //Initialization of all relevant SLAM information
 extern void slam_init(slam_t *slam,
 					  int16_t rob_x_start, int16_t rob_y_start, u_int8_t rob_z_start, int16_t rob_psi_start,
 					  int32_t *odo_l, int32_t *odo_r);
 
+extern void slam_rayprofile_init(slam_t *slam, int16_t value);
+
 //Bases on ts_map_laser_ray
 extern void slam_laserRayToMap(slam_t *slam,
 							   int16_t x1, int16_t y1, int16_t x2, int16_t y2, int16_t xp, int16_t yp,
@@ -95,10 +233,36 @@ extern void slam_laserRayToNav(slam_t *slam,
 
 extern void slam_map_update(slam_t *slam, u8 map, int16_t quality, int16_t hole_width);
 
+extern void slam_scan_fromPolar(slam_t *slam, int16_t first, int16_t n);
+
+extern void slam_filter_init(slam_t *slam);
+
+extern void slam_filter_begin(slam_t *slam, int16_t first);
+
+extern void slam_filter_push(slam_t *slam, int16_t dist);
+
+extern void slam_filter_flush(slam_t *slam);
+
+extern void slam_map_updateRays(slam_t *slam, slam_position_t *pos, slam_scan_t *scan, u8 map, int16_t quality, int16_t hole_width, int16_t first, int16_t last, int16_t stride);
+
+extern u_int8_t slam_map_integrationPolicy(slam_t *slam, int32_t score, u_int32_t dt_ms);
+
 extern int32_t slam_distanceScanToMap(slam_t *slam, slam_position_t *position);
 
 extern void slam_processMovement(slam_t *slam);
 
+extern void slam_applyMovement(slam_t *slam, float dist, float dpsi);
+
+extern void slam_map_setTileDirty(slam_t *slam, slam_map_pixel_t *ptr, u_int8_t flags);
+
+extern void slam_map_decay(slam_t *slam, u_int16_t max_tiles);
+
+extern u_int8_t slam_map_takeDirty(slam_t *slam, u_int8_t flags);
+
+extern void slam_distmap_init(slam_t *slam);
+
+extern void slam_distmap_update(slam_t *slam, u_int16_t max_tiles);
+
 extern void slam_line(slam_t *slam, int x0, int y0, int x1, int y1, int xh, int yh, uint8_t updateRate);
 
 #endif
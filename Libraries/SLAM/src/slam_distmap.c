@@ -0,0 +1,203 @@
+////////////////////////////////////////////////////////////////////////////////
+/// slam_distmap.c - Distance map (likelihood field) of the slam library
+///
+/// Stores the (chamfer-) distance of every pixel to the next obstacle, clamped
+/// to MAP_DISTMAP_MAX. Compared to the raw map the distance map is a smooth
+/// function of the position, so slam_distanceScanToMap converges with less
+/// tries. The map is not calculated from scratch after every scan: Only the
+/// tiles in which a pixel crossed MAP_OBSTACLE_THRESHOLD (marked with
+/// MAP_TILE_DIRTY_DISTMAP while integrating the scan) are recalculated.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "slamdefs.h"
+
+#if SLAM_USE_DISTMAP
+
+#define DISTMAP_TILE_PX		(MAP_TILE_SIZE_PX / MAP_DISTMAP_FAC) //Size of a tile in distance map pixels
+#define DISTMAP_REACH_PX	((MAP_DISTMAP_MAX + MAP_DISTMAP_STEP - 1) / MAP_DISTMAP_STEP) //Max. distance (in pixels) an obstacle has an effect on the distance map
+#define DISTMAP_WIN_PX		(DISTMAP_TILE_PX + 4 * DISTMAP_REACH_PX) //Size of the window that is needed to recalculate one tile
+
+static u_int8_t distmap_win[DISTMAP_WIN_PX][DISTMAP_WIN_PX]; //Working buffer (static, to keep it away from the task stack)
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief distmap_isObstacle
+///		Returns 1 if one of the map pixels covered by the given distance map
+///		pixel is an obstacle.
+
+static u_int8_t distmap_isObstacle(slam_t *slam, int16_t x, int16_t y)
+{
+	slam_map_pixel_t *ptr = &slam->map.px[0][0][slam->robot_pos.coord.z] + (y * MAP_DISTMAP_FAC) * MAP_SIZE_Y_PX + (x * MAP_DISTMAP_FAC);
+
+	for(u8 dy = 0; dy < MAP_DISTMAP_FAC; dy++, ptr += MAP_SIZE_Y_PX)
+		for(u8 dx = 0; dx < MAP_DISTMAP_FAC; dx++)
+			if(ptr[dx] >= MAP_OBSTACLE_THRESHOLD)
+				return 1;
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief distmap_min
+///		Helperfunction: Returns the smaller one of the two values, clamped to
+///		MAP_DISTMAP_MAX
+
+static inline u_int8_t distmap_min(u_int16_t a, u_int16_t b)
+{
+	if(b < a)
+		a = b;
+	return (a > MAP_DISTMAP_MAX) ? MAP_DISTMAP_MAX : a;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief distmap_updateTile
+///		Recalculates the distance map around the given tile. All pixels that
+///		are closer than DISTMAP_REACH_PX to the tile may have changed, and to
+///		calculate them we need all obstacles that are closer than
+///		DISTMAP_REACH_PX to them. So the brushfire (two pass chamfer distance
+///		transformation) is done in a window of the tile size + 2 * 2 *
+///		DISTMAP_REACH_PX, but only the inner part is written back.
+/// \param slam
+///		SLAM container structure
+/// \param tx
+/// \param ty
+///		Tile
+
+static void distmap_updateTile(slam_t *slam, int16_t tx, int16_t ty)
+{
+	int16_t x0, y0, x1, y1; //Window (in distance map pixels)
+	int16_t w, h, x, y;
+
+	x0 = tx * DISTMAP_TILE_PX - 2 * DISTMAP_REACH_PX;
+	y0 = ty * DISTMAP_TILE_PX - 2 * DISTMAP_REACH_PX;
+	x1 = x0 + DISTMAP_WIN_PX;
+	y1 = y0 + DISTMAP_WIN_PX;
+	if(x0 < 0)	x0 = 0;
+	if(y0 < 0)	y0 = 0;
+	if(x1 > MAP_DISTMAP_SIZE_Y_PX)	x1 = MAP_DISTMAP_SIZE_Y_PX;
+	if(y1 > MAP_DISTMAP_SIZE_X_PX)	y1 = MAP_DISTMAP_SIZE_X_PX;
+	w = x1 - x0;
+	h = y1 - y0;
+
+	//Seed: 0 on obstacles, maximum everywhere else
+	for(y = 0; y < h; y++)
+		for(x = 0; x < w; x++)
+			distmap_win[y][x] = distmap_isObstacle(slam, x0 + x, y0 + y) ? 0 : MAP_DISTMAP_MAX;
+
+	//Forward pass (top left to bottom right)
+	for(y = 0; y < h; y++)
+	{
+		for(x = 0; x < w; x++)
+		{
+			u_int8_t d = distmap_win[y][x];
+			if(d == 0)
+				continue;
+			if(x > 0)		d = distmap_min(d, distmap_win[y][x - 1] + MAP_DISTMAP_STEP);
+			if(y > 0)
+			{
+				d = distmap_min(d, distmap_win[y - 1][x] + MAP_DISTMAP_STEP);
+				if(x > 0)		d = distmap_min(d, distmap_win[y - 1][x - 1] + MAP_DISTMAP_STEP_DIAG);
+				if(x < w - 1)	d = distmap_min(d, distmap_win[y - 1][x + 1] + MAP_DISTMAP_STEP_DIAG);
+			}
+			distmap_win[y][x] = d;
+		}
+	}
+
+	//Backward pass (bottom right to top left)
+	for(y = h - 1; y >= 0; y--)
+	{
+		for(x = w - 1; x >= 0; x--)
+		{
+			u_int8_t d = distmap_win[y][x];
+			if(d == 0)
+				continue;
+			if(x < w - 1)	d = distmap_min(d, distmap_win[y][x + 1] + MAP_DISTMAP_STEP);
+			if(y < h - 1)
+			{
+				d = distmap_min(d, distmap_win[y + 1][x] + MAP_DISTMAP_STEP);
+				if(x < w - 1)	d = distmap_min(d, distmap_win[y + 1][x + 1] + MAP_DISTMAP_STEP_DIAG);
+				if(x > 0)		d = distmap_min(d, distmap_win[y + 1][x - 1] + MAP_DISTMAP_STEP_DIAG);
+			}
+			distmap_win[y][x] = d;
+		}
+	}
+
+	//Write back the inner part (tile + DISTMAP_REACH_PX); the border of the window may be wrong
+	int16_t ox0 = tx * DISTMAP_TILE_PX - DISTMAP_REACH_PX;
+	int16_t oy0 = ty * DISTMAP_TILE_PX - DISTMAP_REACH_PX;
+	int16_t ox1 = ox0 + DISTMAP_TILE_PX + 2 * DISTMAP_REACH_PX;
+	int16_t oy1 = oy0 + DISTMAP_TILE_PX + 2 * DISTMAP_REACH_PX;
+	if(ox0 < x0)	ox0 = x0;
+	if(oy0 < y0)	oy0 = y0;
+	if(ox1 > x1)	ox1 = x1;
+	if(oy1 > y1)	oy1 = y1;
+
+	for(y = oy0; y < oy1; y++)
+	{
+		slam_map_distpixel_t *ptr = &slam->map.dist[0][0][slam->robot_pos.coord.z] + y * MAP_DISTMAP_SIZE_Y_PX;
+		for(x = ox0; x < ox1; x++)
+			ptr[x] = distmap_win[y - y0][x - x0];
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_distmap_init
+///		Recalculates the whole distance map from the raw map (e.g. after the
+///		map was cleared).
+/// \param slam
+///		SLAM container structure
+
+void slam_distmap_init(slam_t *slam)
+{
+	for(int16_t ty = 0; ty < MAP_TILES_X; ty++)
+		for(int16_t tx = 0; tx < MAP_TILES_Y; tx++)
+		{
+			distmap_updateTile(slam, tx, ty);
+			slam->map.tile_flags[ty * MAP_TILES_Y + tx] &= ~MAP_TILE_DIRTY_DISTMAP;
+		}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_distmap_update
+///		Recalculates the distance map around all tiles that are marked with
+///		MAP_TILE_DIRTY_DISTMAP. To limit the time needed per call, only
+///		max_tiles tiles are processed, the next call continues with the next
+///		dirty tile.
+/// \param slam
+///		SLAM container structure
+/// \param max_tiles
+///		Maximum amount of tiles to recalculate
+
+void slam_distmap_update(slam_t *slam, u_int16_t max_tiles)
+{
+	u_int16_t i = slam->map.distmap_cursor;
+
+	for(u_int16_t n = 0; n < (MAP_TILES_X * MAP_TILES_Y) && max_tiles > 0; n++)
+	{
+		if(slam->map.tile_flags[i] & MAP_TILE_DIRTY_DISTMAP)
+		{
+			slam->map.tile_flags[i] &= ~MAP_TILE_DIRTY_DISTMAP;
+			distmap_updateTile(slam, i % MAP_TILES_Y, i / MAP_TILES_Y);
+			max_tiles --;
+		}
+
+		if(++i == (MAP_TILES_X * MAP_TILES_Y))
+			i = 0;
+	}
+
+	slam->map.distmap_cursor = i;
+}
+
+#else
+
+void slam_distmap_init(slam_t *slam)
+{
+	(void) slam;
+}
+
+void slam_distmap_update(slam_t *slam, u_int16_t max_tiles)
+{
+	(void) slam;
+	(void) max_tiles;
+}
+
+#endif
@@ -0,0 +1,242 @@
+////////////////////////////////////////////////////////////////////////////////
+/// slam_filter.c - Scan filter of the slam library
+///
+/// Cleans the laserscan before it is matched and integrated into the map:
+/// 1. Range clipping and robot body mask (rays that are too long or hit the
+///    robot itself are dropped)
+/// 2. Angular median of width k (removes single wrong distances, e.g. at the
+///    edges of obstacles where the lidar mixes fore- and background)
+/// 3. Isolated point rejection (a ray that has no neighbour near it is most
+///    likely noise)
+/// The rays are pushed one after the other while the lidar turns. Every stage
+/// only keeps the few rays it needs in small ring buffers, the filtered rays
+/// come out delayed by the reach of the median and the isolated point
+/// rejection (slam_filter_flush at the end of the scan). Rays before the
+/// first and after the last ray of the scan count as missing. No stage
+/// invents rays: A missing ray stays missing.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "slamdefs.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+#define FILTER_MASK		(SLAM_FILTER_RING - 1)
+
+#define SORT2(a, b)		if((a) > (b)) { int16_t t = (a); (a) = (b); (b) = t; } //Compare-exchange of a sorting network
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_filter_init
+///		Default configuration of the filter
+
+void slam_filter_init(slam_t *slam)
+{
+	slam_filter_t *f = &slam->filter;
+
+	f->enabled = (1 << SLAM_FILTER_CLIP) | (1 << SLAM_FILTER_MEDIAN) | (1 << SLAM_FILTER_ISOLATED);
+	f->range_max = SLAM_FILTER_RANGE_MAX;
+	for(u16 i = 0; i < LASERSCAN_POINTS; i++)
+		f->body[i] = SLAM_FILTER_BODY_CM;
+	f->median_k = SLAM_FILTER_MEDIAN_K;
+	f->isolated_mm = SLAM_FILTER_ISOLATED_MM;
+
+	slam_filter_begin(slam, 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_filter_begin
+///		Starts a new scan
+/// \param first
+///		Index (in sensordata.lidar) of the first ray that will be pushed,
+///		the following ones are first + 1, first + 2... (wrapping around)
+
+void slam_filter_begin(slam_t *slam, int16_t first)
+{
+	slam_filter_t *f = &slam->filter;
+
+	if(f->median_k > SLAM_FILTER_MEDIAN_MAX) //The configuration may only change between two scans
+		f->median_k = SLAM_FILTER_MEDIAN_MAX;
+
+	f->first = first;
+	f->n_in = f->n_med = f->n_out = 0;
+	for(u8 s = 0; s < SLAM_FILTER_STAGES; s++)
+	{
+		f->cycles[s] = 0;
+		f->dropped[s] = 0;
+	}
+}
+
+static int16_t filter_index(slam_filter_t *f, int16_t n)
+{
+	int16_t i = f->first + n;
+
+	if(i >= LASERSCAN_POINTS)
+		i -= LASERSCAN_POINTS;
+
+	return i;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief filter_median
+///		Median of the valid values (!= LASERSCAN_NODATA) of v. Complete
+///		windows of 3 or 5 rays (the usual case) are sorted with a sorting
+///		network, incomplete ones with an insertion sort of the valid
+///		values. Even amount of valid values: The lower one of the two.
+/// \param v
+///		Window (is sorted)
+/// \param k
+///		Size of the window (<= SLAM_FILTER_MEDIAN_MAX)
+
+static int16_t filter_median(int16_t *v, u8 k)
+{
+	u8 n = 0;
+
+	for(u8 j = 0; j < k; j++)
+		if(v[j] != LASERSCAN_NODATA)
+			v[n++] = v[j];
+
+	if((n == 3) && (k == 3))
+	{
+		SORT2(v[0], v[1]);
+		SORT2(v[1], v[2]);
+		SORT2(v[0], v[1]);
+		return v[1];
+	}
+	else if((n == 5) && (k == 5))
+	{
+		SORT2(v[0], v[1]);
+		SORT2(v[3], v[4]);
+		SORT2(v[0], v[3]);
+		SORT2(v[1], v[4]);
+		SORT2(v[1], v[2]);
+		SORT2(v[2], v[3]);
+		SORT2(v[1], v[2]);
+		return v[2];
+	}
+
+	for(u8 j = 1; j < n; j++)
+	{
+		int16_t val = v[j];
+		int8_t l = j - 1;
+
+		for(; (l >= 0) && (v[l] > val); l--)
+			v[l + 1] = v[l];
+		v[l + 1] = val;
+	}
+
+	return v[(n - 1) / 2];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief filter_runMedian
+///		Calculates the median of ray f->n_med
+/// \param end
+///		Rays >= end count as missing
+
+static void filter_runMedian(slam_filter_t *f, int16_t end)
+{
+	int16_t n = f->n_med;
+	int16_t c = f->clip[n & FILTER_MASK];
+	int16_t m = c;
+
+	if((c != LASERSCAN_NODATA) && (f->enabled & (1 << SLAM_FILTER_MEDIAN)) && (f->median_k > 1))
+	{
+		int16_t v[SLAM_FILTER_MEDIAN_MAX];
+		int8_t h = f->median_k / 2;
+
+		for(int8_t j = -h; j <= h; j++)
+			v[j + h] = ((n + j < 0) || (n + j >= end)) ? LASERSCAN_NODATA : f->clip[(n + j) & FILTER_MASK];
+
+		m = filter_median(v, 2 * h + 1);
+	}
+
+	f->med[n & FILTER_MASK] = m;
+	f->n_med ++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief filter_runIsolated
+///		Isolated point rejection of ray f->n_out, writes the ray into
+///		sensordata.lidar
+/// \param end
+///		Rays >= end count as missing
+
+static void filter_runIsolated(slam_t *slam, int16_t end)
+{
+	slam_filter_t *f = &slam->filter;
+	int16_t n = f->n_out;
+	int16_t d = f->med[n & FILTER_MASK];
+
+	if((d != LASERSCAN_NODATA) && (f->enabled & (1 << SLAM_FILTER_ISOLATED)))
+	{
+		int16_t lim = f->isolated_mm + (d >> SLAM_FILTER_ISOLATED_SHIFT);
+		int16_t prev = (n > 0) ? f->med[(n - 1) & FILTER_MASK] : LASERSCAN_NODATA;
+		int16_t next = (n + 1 < end) ? f->med[(n + 1) & FILTER_MASK] : LASERSCAN_NODATA;
+
+		if(((prev == LASERSCAN_NODATA) || (abs(prev - d) > lim)) &&
+		   ((next == LASERSCAN_NODATA) || (abs(next - d) > lim)))
+		{
+			d = LASERSCAN_NODATA;
+			f->dropped[SLAM_FILTER_ISOLATED] ++;
+		}
+	}
+
+	slam->sensordata.lidar[filter_index(f, n)] = d;
+	f->n_out ++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_filter_push
+///		Adds the next ray of the scan. The rays that are completely
+///		filtered afterwards (up to slam->filter.n_out) are in
+///		sensordata.lidar.
+/// \param dist
+///		Measured distance (LASERSCAN_NODATA: no measurement)
+
+void slam_filter_push(slam_t *slam, int16_t dist)
+{
+	slam_filter_t *f = &slam->filter;
+	u_int32_t t0 = DWT_CYCCNT, t1, t2;
+
+	if((dist != LASERSCAN_NODATA) && (f->enabled & (1 << SLAM_FILTER_CLIP)) &&
+	   ((dist > f->range_max) || (dist < f->body[filter_index(f, f->n_in)] * 10)))
+	{
+		dist = LASERSCAN_NODATA;
+		f->dropped[SLAM_FILTER_CLIP] ++;
+	}
+	f->clip[f->n_in & FILTER_MASK] = dist;
+	f->n_in ++;
+
+	t1 = DWT_CYCCNT;
+	if(f->n_in - f->n_med > f->median_k / 2) //Window of the next median complete
+		filter_runMedian(f, LASERSCAN_POINTS);
+
+	t2 = DWT_CYCCNT;
+	if(f->n_med - f->n_out > 1) //Both neighbours through the median
+		filter_runIsolated(slam, LASERSCAN_POINTS);
+
+	f->cycles[SLAM_FILTER_CLIP] += t1 - t0;
+	f->cycles[SLAM_FILTER_MEDIAN] += t2 - t1;
+	f->cycles[SLAM_FILTER_ISOLATED] += DWT_CYCCNT - t2;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_filter_flush
+///		End of the scan: Filters the remaining rays (the rays after the
+///		last pushed one count as missing)
+
+void slam_filter_flush(slam_t *slam)
+{
+	slam_filter_t *f = &slam->filter;
+	u_int32_t t0 = DWT_CYCCNT, t1;
+
+	while(f->n_med < f->n_in)
+		filter_runMedian(f, f->n_in);
+
+	t1 = DWT_CYCCNT;
+	while(f->n_out < f->n_in)
+		filter_runIsolated(slam, f->n_in);
+
+	f->cycles[SLAM_FILTER_MEDIAN] += t1 - t0;
+	f->cycles[SLAM_FILTER_ISOLATED] += DWT_CYCCNT - t1;
+}
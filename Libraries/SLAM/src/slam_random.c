@@ -15,8 +15,9 @@
 /// \param stop
 ///		Amount of tries
 /// \return
-///		Value proportional to the degree of matching
-int16_t slam_monteCarloSearch(slam_t *slam, int16_t sigma_xy, int16_t sigma_psi, uint16_t stop)
+///		Value proportional to the degree of matching (see slam_distanceScanToMap,
+///		up to SLAM_MATCH_SCORE_MAX)
+int32_t slam_monteCarloSearch(slam_t *slam, int16_t sigma_xy, int16_t sigma_psi, uint16_t stop)
 {
 	slam_position_t currentpos; //Stores position with the current spreading
 	slam_position_t bestpos; //Stores position with the best matching position
@@ -50,6 +50,142 @@ void slam_init(slam_t *slam,
 	slam->sensordata.odo_r = odo_r;
 	slam->sensordata.odo_l_old = *slam->sensordata.odo_l;
 	slam->sensordata.odo_r_old = *slam->sensordata.odo_r;
+
+	for(u16 i = 0; i < (MAP_TILES_X * MAP_TILES_Y); i++)
+	{
+		slam->map.tile_flags[i] = MAP_TILE_DIRTY_LCD | MAP_TILE_DIRTY_PCUI;
+		slam->map.tile_seen[i] = 0;
+	}
+	slam->map.distmap_cursor = 0;
+	slam->map.decay_cycle = 0;
+	slam->map.decay_cursor = 0;
+
+	slam_rayprofile_init(slam, IS_OBSTACLE);
+
+	slam->mapint.pos_integrated = slam->mapint.pos_last = slam->robot_pos;
+	slam->mapint.skipped = 0;
+	slam->mapint.integrated = 0;
+
+	slam_filter_init(slam);
+
+#if SLAM_USE_DISTMAP
+	slam_distmap_init(slam);
+	slam->matchmode = SLAM_MATCH_DISTMAP;
+#else
+	slam->matchmode = SLAM_MATCH_RAW;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_rayprofile_init
+///		Precomputes everything of the laser ray integration that does not
+///		depend on the measurement: sin/cos of every ray angle and the
+///		triangular hole profile (increment of the pixel value per pixel and
+///		its remainder, see slam_map_update) for every half hole length
+///		derrorv < SLAM_RAYPROFILE_LEN.
+/// \param slam
+///		SLAM container structure
+/// \param value
+///		Value (top of the hole profile) the rays are integrated with
+
+void slam_rayprofile_init(slam_t *slam, int16_t value)
+{
+	for(u16 i = 0; i < LASERSCAN_POINTS; i++)
+	{
+		slam->rayprofile.ray_sin[i] = sinf(i * (M_PI / 180));
+		slam->rayprofile.ray_cos[i] = cosf(i * (M_PI / 180));
+	}
+
+	slam->rayprofile.value = value;
+	slam->rayprofile.incv[0] = 0; //No hole -> nothing to increment (and no division by zero)
+	slam->rayprofile.incerrorv[0] = 0;
+	for(int16_t derrorv = 1; derrorv < SLAM_RAYPROFILE_LEN; derrorv++)
+	{
+		slam->rayprofile.incv[derrorv] = (value - NO_OBSTACLE) / derrorv;
+		slam->rayprofile.incerrorv[derrorv] = value - NO_OBSTACLE - derrorv * slam->rayprofile.incv[derrorv];
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_scan_fromPolar
+///		Converts the polar laserscan (slam->sensordata.lidar) into the
+///		cartesian one (slam->sensordata.scan) without any motion correction.
+///		Rays with a signal strength below SLAM_STRENGTH_MIN are dropped, the
+///		others are weighted by their strength.
+/// \param slam
+///		SLAM container structure
+/// \param first
+///		First ray to convert
+/// \param n
+///		Amount of rays to convert (continues at ray 0 after the last one)
+
+void slam_scan_fromPolar(slam_t *slam, int16_t first, int16_t n)
+{
+	for(int16_t i = first; n > 0; n--)
+	{
+		u_int16_t strength = slam->sensordata.strength[i];
+
+		if((slam->sensordata.lidar[i] != LASERSCAN_NODATA) && (strength >= SLAM_STRENGTH_MIN))
+		{
+			slam->sensordata.scan.x[i] = (int16_t)floorf(slam->sensordata.lidar[i] * slam->rayprofile.ray_sin[i] + 0.5);
+			slam->sensordata.scan.y[i] = (int16_t)floorf(slam->sensordata.lidar[i] * slam->rayprofile.ray_cos[i] + 0.5);
+			if(strength >= SLAM_STRENGTH_FULL)
+				slam->sensordata.scan.w[i] = SLAM_WEIGHT_FULL;
+			else
+				slam->sensordata.scan.w[i] = 1 + (strength * (SLAM_WEIGHT_FULL - 1)) / SLAM_STRENGTH_FULL;
+		}
+		else
+		{
+			slam->sensordata.scan.x[i] = slam->sensordata.scan.y[i] = 0;
+			slam->sensordata.scan.w[i] = 0;
+		}
+
+		if(++i == LASERSCAN_POINTS)
+			i = 0;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_rayprofile_get
+///		Returns the hole profile for the given half hole length; from the
+///		table if it was precomputed, otherwise calculated.
+
+static inline void slam_rayprofile_get(slam_t *slam, int16_t value, int16_t derrorv, int16_t *incv, int16_t *incerrorv)
+{
+	if((derrorv < SLAM_RAYPROFILE_LEN) && (value == slam->rayprofile.value))
+	{
+		*incv = slam->rayprofile.incv[derrorv];
+		*incerrorv = slam->rayprofile.incerrorv[derrorv];
+	}
+	else if(derrorv > 0)
+	{
+		*incv = (value - NO_OBSTACLE) / derrorv;
+		*incerrorv = value - NO_OBSTACLE - derrorv * (*incv);
+	}
+	else
+	{
+		*incv = 0;
+		*incerrorv = 0;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief slam_map_setTileDirty
+///		Sets the given dirty flags of the tile the given map pixel lies in.
+/// \param slam
+///		SLAM container structure
+/// \param ptr
+///		Pointer to the map pixel (in slam->map.px)
+/// \param flags
+///		MAP_TILE_DIRTY_... flags to set
+
+void slam_map_setTileDirty(slam_t *slam, slam_map_pixel_t *ptr, u_int8_t flags)
+{
+	int32_t offset = ptr - &slam->map.px[0][0][slam->robot_pos.coord.z];
+	int32_t y = offset / MAP_SIZE_Y_PX;
+	int32_t x = offset - (y * MAP_SIZE_Y_PX);
+
+	slam->map.tile_flags[(y / MAP_TILE_SIZE_PX) * MAP_TILES_Y + (x / MAP_TILE_SIZE_PX)] |= flags;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
@@ -82,7 +218,7 @@ void slam_laserRayToMap(slam_t *slam,
 {
 	int16_t x2c, y2c, dx, dy, dxc, dyc, error, errorv, derrorv, x;
 	int16_t incv, sincv, incerrorv, incptrx, incptry, pixval, horiz, diago;
-	slam_map_pixel_t *ptr;
+	slam_map_pixel_t *ptr, pixold;
 
 	if ((x1 < 0) || (x1 >= (MAP_SIZE_X_MM/MAP_RESOLUTION_MM)) || (y1 < 0) || (y1 >= (MAP_SIZE_Y_MM/MAP_RESOLUTION_MM)))
 		return; // Robot is out of map
@@ -140,8 +276,7 @@ void slam_laserRayToMap(slam_t *slam,
 	horiz = 2 * dyc;
 	diago = 2 * (dyc - dxc);
 	errorv = derrorv / 2;
-	incv = (value - NO_OBSTACLE) / derrorv;
-	incerrorv = value - NO_OBSTACLE - derrorv * incv;
+	slam_rayprofile_get(slam, value, derrorv, &incv, &incerrorv);
 /*
 	int16_t index_x = x1;
 	int16_t index_y = y1;
@@ -214,7 +349,10 @@ void slam_laserRayToMap(slam_t *slam,
 			}
 		}
 		// Integration into the map
-		*ptr = ((256 - alpha) * (*ptr) + alpha * pixval) >> 8;
+		pixold = *ptr;
+		*ptr = ((256 - alpha) * pixold + alpha * pixval) >> 8;
+		if(*ptr != pixold) //Every change is drawn and sent, the distance map only changes if the pixel changed from free to obstacle or the other way round
+			slam_map_setTileDirty(slam, ptr, ((pixold >= MAP_OBSTACLE_THRESHOLD) != (*ptr >= MAP_OBSTACLE_THRESHOLD)) ? MAP_TILE_DIRTY_ALL : (MAP_TILE_DIRTY_LCD | MAP_TILE_DIRTY_PCUI));
 		if (error > 0)
 		{
 			ptr += incptry;
@@ -289,8 +427,7 @@ void slam_laserRayToNav(slam_t *slam,
 	horiz = 2 * dyc;
 	diago = 2 * (dyc - dxc);
 	errorv = derrorv / 2;
-	incv = (value - NO_OBSTACLE) / derrorv;
-	incerrorv = value - NO_OBSTACLE - derrorv * incv;
+	slam_rayprofile_get(slam, value, derrorv, &incv, &incerrorv);
 
 	ptr = &slam->map.nav[0][0][slam->robot_pos.coord.z] + y1 * MAP_NAV_SIZE_Y_PX + x1;
 	pixval = NO_OBSTACLE;
@@ -411,47 +548,244 @@ void slam_line(slam_t *slam, int xs, int ys, int xe, int ye, int xh, int yh, uin
 
 void slam_map_update(slam_t *slam, u8 map, int16_t quality, int16_t hole_width)
 {
-	float c, s;
-	float x2p, y2p;
-	int16_t i, x1, y1, x2, y2, xp, yp;
-	float add, dist;
+	slam_map_updateRays(slam, &slam->robot_pos, &slam->sensordata.scan, map, quality, hole_width, 0, LASERSCAN_POINTS, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief slam_map_confirmRay
+///		Stamps every tile the ray passes through with the current decay cycle
+///		(see slam_map_decay): The free space it crosses is confirmed as well as
+///		the obstacle at its end. Samples the ray every half tile.
+/// \param x1
+/// \param y1
+///		Start of the ray
+/// \param x2
+/// \param y2
+///		End of the ray (end of the hole behind the obstacle)
 
-	float lidar_x, lidar_y;
+static void slam_map_confirmRay(slam_t *slam, int16_t x1, int16_t y1, int16_t x2, int16_t y2)
+{
+	int16_t n = ((abs(x2 - x1) > abs(y2 - y1)) ? abs(x2 - x1) : abs(y2 - y1)) * 2 / MAP_TILE_SIZE_PX + 1;
+	int32_t x = x1 * 256, y = y1 * 256; //Fixed point, 8 bits fraction
+	int32_t dx = (x2 - x1) * 256 / n, dy = (y2 - y1) * 256 / n;
+	int16_t xt, yt;
+
+	for(int16_t k = 0; k <= n; k++, x += dx, y += dy)
+	{
+		xt = (x + 128) / 256;
+		yt = (y + 128) / 256;
+		if((xt >= 0) && (xt < MAP_SIZE_Y_PX) && (yt >= 0) && (yt < MAP_SIZE_X_PX))
+			slam->map.tile_seen[(yt / MAP_TILE_SIZE_PX) * MAP_TILES_Y + (xt / MAP_TILE_SIZE_PX)] = slam->map.decay_cycle;
+	}
+}
 
-	c = cosf((slam->robot_pos.psi) * M_PI / 180);
-	s = sinf((slam->robot_pos.psi) * M_PI / 180);
-	x1 = (int16_t)floorf(slam->robot_pos.coord.y / MAP_RESOLUTION_MM + 0.5); //!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-	y1 = (int16_t)floorf((slam->robot_pos.coord.x) / MAP_RESOLUTION_MM + 0.5);
+////////////////////////////////////////////////////////////////////////////////
+/// \brief slam_map_updateRays
+///		Integrates the rays first...last-1 of the given scan, seen from the given
+///		position, into the map. Same as slam_map_update, but independent of the
+///		current robot position and scan in the slam structure, so that a scan
+///		can be integrated later and in parts (see vMAPTask).
+/// \param slam
+///		SLAM container structure
+/// \param pos
+///		Position of the robot at the time of the scan
+/// \param scan
+///		Scan (cartesian, see slam_scan_t)
+/// \param map
+///		Update raw map or the navigation area
+/// \param quality
+///		See slam_map_update. Scaled down for weak rays (scan->w).
+/// \param hole_width
+///		See slam_map_update
+/// \param first
+/// \param last
+///		Range of rays to integrate
+/// \param stride
+///		Integrate only every stride-th ray of the range (1: all rays)
+
+void slam_map_updateRays(slam_t *slam, slam_position_t *pos, slam_scan_t *scan, u8 map, int16_t quality, int16_t hole_width, int16_t first, int16_t last, int16_t stride)
+{
+	float c, s;
+	float x2p, y2p, hole_x, hole_y;
+	int16_t i, x1, y1, x2, y2, xp, yp;
+	float hole_c, hole_s, pos_x_px, pos_y_px;
+	int16_t alpha;
+
+	c = cosf((pos->psi) * M_PI / 180);
+	s = sinf((pos->psi) * M_PI / 180);
+	hole_c = c * hole_width / (2 * MAP_RESOLUTION_MM); //Half hole width in pixels (the hole is the same for every ray), rotated into the map
+	hole_s = s * hole_width / (2 * MAP_RESOLUTION_MM);
+	pos_x_px = pos->coord.y / MAP_RESOLUTION_MM; //!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+	pos_y_px = pos->coord.x / MAP_RESOLUTION_MM;
+	x1 = (int16_t)floorf(pos_x_px + 0.5);
+	y1 = (int16_t)floorf(pos_y_px + 0.5);
 	// Translate and rotate scan to robot position
-	for (i = 0; i < LASERSCAN_POINTS; i++)
+	for (i = first; i < last; i += stride)
 	{
-		if(slam->sensordata.lidar[i] != LASERSCAN_NODATA)
+		if((scan->x[i] != 0) || (scan->y[i] != 0))
 		{
-			lidar_x = (slam->sensordata.lidar[i] * sinf(i * (M_PI / 180)));
-			lidar_y = (slam->sensordata.lidar[i] * cosf(i * (M_PI / 180)));
-
-			x2p = c * lidar_x - s * lidar_y;
-			y2p = s * lidar_x + c * lidar_y;
+			x2p = (c * scan->x[i] - s * scan->y[i]) / MAP_RESOLUTION_MM; //Ray in the map (pixels)
+			y2p = (s * scan->x[i] + c * scan->y[i]) / MAP_RESOLUTION_MM;
+			hole_x = hole_c * slam->rayprofile.ray_sin[i] - hole_s * slam->rayprofile.ray_cos[i]; //hole_width/2 in the direction of the ray (of the sensor, the de-skewing barely turns it)
+			hole_y = hole_s * slam->rayprofile.ray_sin[i] + hole_c * slam->rayprofile.ray_cos[i];
 
-			xp = (int)floorf((slam->robot_pos.coord.y + x2p) / MAP_RESOLUTION_MM + 0.5);//!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-			yp = (int)floorf((slam->robot_pos.coord.x + y2p) / MAP_RESOLUTION_MM + 0.5);
+			xp = (int)floorf(pos_x_px + x2p + 0.5);
+			yp = (int)floorf(pos_y_px + y2p + 0.5);
 
-			dist = sqrtf(x2p * x2p + y2p * y2p);
-			add = hole_width / 2 / dist;
-			x2p = x2p / MAP_RESOLUTION_MM * (1 + add);
-			y2p = y2p / MAP_RESOLUTION_MM * (1 + add);
+			x2 = (int16_t)floorf(pos_x_px + x2p + hole_x + 0.5); //End of the hole: hole_width/2 behind the obstacle
+			y2 = (int16_t)floorf(pos_y_px + y2p + hole_y + 0.5);
 
-			x2 = (int16_t)floorf(slam->robot_pos.coord.y / MAP_RESOLUTION_MM + x2p + 0.5);//!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-			y2 = (int16_t)floorf(slam->robot_pos.coord.x / MAP_RESOLUTION_MM + y2p + 0.5);
+			alpha = (quality * scan->w[i] + SLAM_WEIGHT_FULL / 2) / SLAM_WEIGHT_FULL; //Weak rays change the map slower
+			if(alpha < 1)
+				alpha = 1;
 
-			if(map)	slam_laserRayToMap(slam, x1, y1, x2, y2, xp, yp, IS_OBSTACLE, quality);
-			else	slam_laserRayToNav(slam, x1/3, y1/3, x2/3, y2/3, xp/3, yp/3, IS_OBSTACLE, quality);
+			if(map)
+			{
+				slam_laserRayToMap(slam, x1, y1, x2, y2, xp, yp, IS_OBSTACLE, alpha);
+				slam_map_confirmRay(slam, x1, y1, x2, y2);
+			}
+			else	slam_laserRayToNav(slam, x1/3, y1/3, x2/3, y2/3, xp/3, yp/3, IS_OBSTACLE, alpha);
 		}
 	}
 	//for(int i = 0; i < MAP_SIZE_X_MM / (MAP_RESOLUTION_MM * 3); i++)
 	//	slam->map.nav[i][i][0] = i;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// \brief slam_map_decay
+///		Pulls the obstacle pixels (> 127) of tiles no laser ray passed through
+///		for MAP_DECAY_AGE calls back towards 127 (unknown). Free space is left
+///		alone: A ghost is always an obstacle. Only max_tiles tiles are
+///		processed per call (the next call continues with the next tile), so the
+///		time needed per scan stays the same. Changed tiles are marked dirty.
+///		Has to be called once per integrated scan.
+/// \param slam
+///		SLAM container structure
+/// \param max_tiles
+///		Amount of tiles to process
+
+void slam_map_decay(slam_t *slam, u_int16_t max_tiles)
+{
+	u_int16_t i = slam->map.decay_cursor;
+	slam_map_pixel_t *ptr, pixold;
+	u_int8_t flags;
+
+	slam->map.decay_cycle ++;
+
+	for(; max_tiles > 0; max_tiles--)
+	{
+		if((u_int8_t)(slam->map.decay_cycle - slam->map.tile_seen[i]) > MAP_DECAY_AGE)
+		{
+			slam->map.tile_seen[i] = slam->map.decay_cycle - MAP_DECAY_AGE - 1; //Keep the age saturated (u_int8_t overflow)
+
+			flags = 0;
+			ptr = &slam->map.px[0][0][slam->robot_pos.coord.z] + (i / MAP_TILES_Y) * MAP_TILE_SIZE_PX * MAP_SIZE_Y_PX + (i % MAP_TILES_Y) * MAP_TILE_SIZE_PX;
+			for(u8 y = 0; y < MAP_TILE_SIZE_PX; y++, ptr += MAP_SIZE_Y_PX)
+			{
+				for(u8 x = 0; x < MAP_TILE_SIZE_PX; x++)
+				{
+					pixold = ptr[x];
+					if(pixold <= 127)
+						continue;
+					ptr[x] = pixold - ((pixold - 127 + (1 << MAP_DECAY_SHIFT) - 1) >> MAP_DECAY_SHIFT); //Round up, so that every pixel reaches 127
+
+					flags |= MAP_TILE_DIRTY_LCD | MAP_TILE_DIRTY_PCUI;
+					if((pixold >= MAP_OBSTACLE_THRESHOLD) != (ptr[x] >= MAP_OBSTACLE_THRESHOLD))
+						flags |= MAP_TILE_DIRTY_DISTMAP;
+				}
+			}
+			slam->map.tile_flags[i] |= flags;
+		}
+
+		if(++i == (MAP_TILES_X * MAP_TILES_Y))
+			i = 0;
+	}
+
+	slam->map.decay_cursor = i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief slam_map_takeDirty
+///		Returns 1 if at least one tile has one of the given dirty flags and
+///		clears them in all tiles.
+/// \param slam
+///		SLAM container structure
+/// \param flags
+///		MAP_TILE_DIRTY_... flags
+
+u_int8_t slam_map_takeDirty(slam_t *slam, u_int8_t flags)
+{
+	u_int8_t dirty = 0;
+
+	for(u16 i = 0; i < (MAP_TILES_X * MAP_TILES_Y); i++)
+	{
+		if(slam->map.tile_flags[i] & flags)
+		{
+			dirty = 1;
+			slam->map.tile_flags[i] &= ~flags;
+		}
+	}
+
+	return dirty;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief slam_map_integrationPolicy
+///		Decides whether and how dense the current scan (matched at
+///		slam->robot_pos) is integrated into the map:
+///		- Not at all if the match is bad (a wrong position would smear the map)
+///		  or if the robot barely moved since the last integration (redundant;
+///		  but at least every SLAM_MAPINT_SKIP_MAX+1-th scan is integrated).
+///		- Partially (every SLAM_MAPINT_STRIDE_PARTIAL-th ray) if the match is
+///		  mediocre or the robot turns fast (distorted scan).
+///		- Fully otherwise.
+/// \param slam
+///		SLAM container structure
+/// \param score
+///		Result of slam_monteCarloSearch
+/// \param dt_ms
+///		Time since the last call (last scan) in ms
+/// \return
+///		Stride for slam_map_updateRays, 0 if the scan shall not be integrated
+
+u_int8_t slam_map_integrationPolicy(slam_t *slam, int32_t score, u_int32_t dt_ms)
+{
+	float dx, dy, dpsi, turnrate;
+	u_int8_t stride = 1;
+
+	dpsi = fabsf(remainderf(slam->robot_pos.psi - slam->mapint.pos_last.psi, 360)); //Turning rate since the last scan
+	turnrate = (dt_ms > 0) ? (dpsi * 1000 / dt_ms) : 0;
+	slam->mapint.pos_last = slam->robot_pos;
+
+	if(!slam->mapint.integrated) //Empty map: Always take the first scan
+		stride = 1;
+	else if(score < SLAM_MAPINT_SCORE_MIN)
+		return 0;
+	else
+	{
+		dx = slam->robot_pos.coord.x - slam->mapint.pos_integrated.coord.x;
+		dy = slam->robot_pos.coord.y - slam->mapint.pos_integrated.coord.y;
+		dpsi = fabsf(remainderf(slam->robot_pos.psi - slam->mapint.pos_integrated.psi, 360));
+
+		if((dx * dx + dy * dy < SLAM_MAPINT_MOVE_MIN_MM * SLAM_MAPINT_MOVE_MIN_MM) &&
+		   (dpsi < SLAM_MAPINT_TURN_MIN) &&
+		   (slam->mapint.skipped < SLAM_MAPINT_SKIP_MAX))
+		{
+			slam->mapint.skipped ++;
+			return 0;
+		}
+
+		if((score < SLAM_MAPINT_SCORE_PARTIAL) || (turnrate > SLAM_MAPINT_TURNRATE_PARTIAL))
+			stride = SLAM_MAPINT_STRIDE_PARTIAL;
+	}
+
+	slam->mapint.pos_integrated = slam->robot_pos;
+	slam->mapint.skipped = 0;
+	slam->mapint.integrated = 1;
+
+	return stride;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 /// \brief slam_distanceScanToMap
 ///		Matches the Laserscan on the given position in the map
@@ -461,12 +795,14 @@ void slam_map_update(slam_t *slam, u8 map, int16_t quality, int16_t hole_width)
 ///		position in the map that shall be compared by the lidar scan
 /// \return
 ///		number that is proportional to the ambiguity (around 230000 fully matching),
-///		-1 if no match found
+///		-1 if no match found. Depending on slam->matchmode the raw map pixels or
+///		the distance map (SLAM_MATCH_DISTMAP) are used for the comparison. Every
+///		ray counts with its weight (signal strength).
 
 int32_t slam_distanceScanToMap(slam_t *slam, slam_position_t *position)
 {
 	float c, s, lidar_x, lidar_y;
-	int32_t i, x, y, nb_points = 0;
+	int32_t i, x, y, w, nb_points = 0;
 	float sum = 0;
 
 	c = cosf((position->psi) * M_PI / 180); //Calculate it here, not nessesary to calculate in every iteration in the loop
@@ -475,18 +811,24 @@ int32_t slam_distanceScanToMap(slam_t *slam, slam_position_t *position)
 	// and compute the distance
 	for (i = 0; i < LASERSCAN_POINTS; i += 10) //LASERSCAN_POINTS: 360. For every 10th measurement.
 	{
-		if(slam->sensordata.lidar[i] != LASERSCAN_NODATA) //If the quality of the measurement is high enough and not out of range
+		if((slam->sensordata.scan.x[i] != 0) || (slam->sensordata.scan.y[i] != 0)) //If the quality of the measurement is high enough and not out of range
 		{
-			lidar_x = (slam->sensordata.lidar[i] * sinf(i * (M_PI / 180))); //Convert from polar to cartesian
-			lidar_y = (slam->sensordata.lidar[i] * cosf(i * (M_PI / 180)));
+			lidar_x = slam->sensordata.scan.x[i]; //Already cartesian (see slam_scan_t)
+			lidar_y = slam->sensordata.scan.y[i];
 
 			x = (int32_t)floorf((position->coord.y + c * lidar_x - s * lidar_y) / MAP_RESOLUTION_MM + 0.5); //Calculate the point in which the Measurement ends as seen from the robot.
 			y = (int32_t)floorf((position->coord.x + s * lidar_x + c * lidar_y) / MAP_RESOLUTION_MM + 0.5); //Workaround: y- and y- position has to be changed due to strange mirroring error...
 
 			if((x >= 0) && (x < (MAP_SIZE_X_MM/MAP_RESOLUTION_MM)) && (y >= 0) && (y < (MAP_SIZE_Y_MM/MAP_RESOLUTION_MM))) //Point lies inside the map size!
 			{
-				sum += *(&slam->map.px[0][0][slam->robot_pos.coord.z] + y * (MAP_SIZE_Y_MM / MAP_RESOLUTION_MM) + x); //Access array by pointer-arithemtics, add value to sum
-				nb_points++;
+				w = slam->sensordata.scan.w[i];
+#if SLAM_USE_DISTMAP
+				if(slam->matchmode == SLAM_MATCH_DISTMAP) //The nearer the ray end is to an obstacle, the higher the value
+					sum += w * (MAP_DISTMAP_MAX - *(&slam->map.dist[0][0][slam->robot_pos.coord.z] + (y / MAP_DISTMAP_FAC) * MAP_DISTMAP_SIZE_Y_PX + (x / MAP_DISTMAP_FAC)));
+				else
+#endif
+					sum += w * *(&slam->map.px[0][0][slam->robot_pos.coord.z] + y * (MAP_SIZE_Y_MM / MAP_RESOLUTION_MM) + x); //Access array by pointer-arithemtics, add value to sum
+				nb_points += w; //Sum of the weights
 			}
 		}
 	}
@@ -510,7 +852,7 @@ int32_t slam_distanceScanToMap(slam_t *slam, slam_position_t *position)
 void slam_processMovement(slam_t *slam)
 {
 	float dl_enc, dr_enc; //Driven distance (since last function call) in mm.
-	float dx = 0, dy = 0, dpsi = 0, dist_driven = 0;
+	float dpsi = 0, dist_driven = 0;
 
 	dl_enc = (*slam->sensordata.odo_l - slam->sensordata.odo_l_old) * 2 * WHEELRADIUS * M_PI / TICKSPERREV; //Calculate difference driven distance in mm
 	dr_enc = (*slam->sensordata.odo_r - slam->sensordata.odo_r_old) * 2 * WHEELRADIUS * M_PI / TICKSPERREV;
@@ -519,23 +861,34 @@ void slam_processMovement(slam_t *slam)
 
 	if(fabsf(dl_enc - dr_enc) > 0) //If robot has driven a curve
 	{
-		float r = -WHEELDIST * (dl_enc + dr_enc) / (2 * (dr_enc - dl_enc)); //Helpervariable
+		float r = -WHEELDIST * (dl_enc + dr_enc) / (2 * (dr_enc - dl_enc)); //Radius of the curve
 		dpsi = -(dr_enc - dl_enc) / WHEELDIST; //Calculate change of rotation (orientation) of robot
 
-		dx = r * sinf(dpsi + (slam->robot_pos.psi * 180 / M_PI)) - r * sinf((slam->robot_pos.psi * 180 / M_PI)); //Calculate change of cartesian x in relation to last robot position
-		dy = -r * cosf(dpsi + (slam->robot_pos.psi * 180 / M_PI)) + r * cosf((slam->robot_pos.psi * 180 / M_PI)); //...y
+		dist_driven = 2 * r * sinf(dpsi / 2); //Chord of the arc (negative if driven backwards)
 
 		dpsi *= 180 / M_PI; //Convert radian to degree
 	}
 	else // basically going straight
 	{
-		dx = dl_enc * cosf(slam->robot_pos.psi * M_PI / 180); //No change of rotation
-		dy = dr_enc * sinf(slam->robot_pos.psi * M_PI / 180);
+		dist_driven = (dl_enc + dr_enc) / 2; //No change of rotation
 	}
 
-	dist_driven = sqrtf(dx * dx + dy * dy); //Driven distance
+	slam_applyMovement(slam, dist_driven, dpsi);
+}
 
-	slam->robot_pos.coord.x += dist_driven * cosf((180 - slam->robot_pos.psi + dpsi) * M_PI / 180); //The calculated values were given as change of position in relation to the last robot position. Now we have to calculate the new absolute position.
-	slam->robot_pos.coord.y += dist_driven * sinf((180 - slam->robot_pos.psi + dpsi) * M_PI / 180);
+//////////////////////////////////////////////////////////////////////////////////////////
+/// \brief slam_applyMovement
+///		Adds a movement (e.g. from the odometry, see odo_delta) to the robot position.
+/// \param slam
+///		slam container structure
+/// \param dist
+///		Driven distance in mm (negative: backwards)
+/// \param dpsi
+///		Change of the orientation in degree
+
+void slam_applyMovement(slam_t *slam, float dist, float dpsi)
+{
+	slam->robot_pos.coord.x += dist * cosf((180 - slam->robot_pos.psi - dpsi / 2) * M_PI / 180); //The chord points in the mean direction of the old and the new orientation
+	slam->robot_pos.coord.y += dist * sinf((180 - slam->robot_pos.psi - dpsi / 2) * M_PI / 180);
 	slam->robot_pos.psi += dpsi;
 }
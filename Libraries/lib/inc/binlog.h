@@ -0,0 +1,39 @@
+/////////////////////////////////////////////////////////////////////////////////
+/// Binary log messages - format table shared with the decoder on the PC
+/////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+//Format table: BINLOG_MSG(id, format). The robot only sends the id and the
+//arguments (boutf), tools/binlog_decode.c formats them with the same table.
+//Only integer conversions (%i %d %u %x %X %c with fill and width), every
+//argument is sent as 32 bit value. New messages are appended at the end, so
+//logs of older firmware can still be decoded.
+#define BINLOG_MESSAGES \
+	BINLOG_MSG(LOG_SLAM_FILTER,		"filter: clip %i (%i cycles), median (%i cycles), isolated %i (%i cycles)\n") \
+	BINLOG_MSG(LOG_SLAM_MATCH,		"time: %i, quality: %i, pos x: %i, pos y: %i, psi: %i, new amounts: %i, stride: %i\n")
+
+enum BINLOG_ID {
+#define BINLOG_MSG(id, format)	id,
+	BINLOG_MESSAGES
+#undef BINLOG_MSG
+	BINLOG_IDS
+};
+
+//Frame: [BINLOG_START0][BINLOG_START1][id][n][systemTick (4)][n * argument (4)][checksum]
+//All values little endian, checksum: Sum of the bytes from id on (8 bit). The
+//start bytes never appear in the text of the streams (ASCII).
+#define BINLOG_START0		0xFE
+#define BINLOG_START1		'L'
+#define BINLOG_HEADER		8 //Start bytes, id, n, systemTick
+#define BINLOG_ARGS_MAX		8
+#define BINLOG_FRAME_MAX	(BINLOG_HEADER + 4 * BINLOG_ARGS_MAX + 1)
+
+//Writes the frame into buf (BINLOG_FRAME_MAX bytes) and returns its length
+extern u_int8_t binlog_pack(u_int8_t *buf, u_int32_t t, u_int8_t id, u_int8_t n, const int32_t *args);
+
+#endif // BINLOG_H
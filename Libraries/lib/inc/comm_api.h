@@ -7,7 +7,8 @@
 
 #define UART_COMM_BAUD_RATE    115200
 
-#define COMM_BUFSIZE 128 //In Bytes. Buffer for read/write access
+#define COMM_TIMEOUT_MS	5 //Max. time for the answer of the slave (longest package at 1MBaud: 1.3ms)
+#define COMM_RXBUF_SIZE	128 //Receive buffer of the DMA (the interrupts empty it every half)
 
 #define COMM_BATCH_WRITE	0x80 //Batch write bit
 #define COMM_BATCH			0x7F //Batch length bits
@@ -21,8 +22,15 @@ typedef struct {
 	uint16_t checksum;
 } comm_msg_t;
 
+//Message of comm_transferBatch
+typedef struct {
+	comm_msg_t *msg; //Message to send
+	uint8_t *rx; //Buffer for the answer of a read request (msg->batch bytes)
+	uint8_t ok; //Result: 1 if the slave answered
+} comm_xfer_t;
+
 typedef enum {
-	WAITFORPACKAGE,
+	WAITFORPACKAGE, GET_SEQ,
 	GET_REGISTER, GET_BATCH, GET_DATA, GET_CHK_LSB, GET_CHK_MSB,
 	NEWMESSAGE
 } COMM_SM;
@@ -63,29 +71,22 @@ typedef enum {
 	COMM_REGISTERS_CNT
 } REGISTERS;
 
-extern comm_msg_t receivedMessage;
-extern uint8_t messageBuffer[COMM_BUFSIZE];
-extern comm_msg_t sendMessage;
-
 //Initialisation of the comm interface
 extern void comm_init(void);
 
 //calculates checksum of the given message
 extern uint16_t comm_calcChecksum(comm_msg_t *msg);
 
-//Sends given package
-extern void comm_sendPackage(comm_msg_t *msg);
+//Sends given package (DMA, does not wait until it is sent)
+extern uint8_t comm_sendPackage(comm_msg_t *msg);
 
-//Sends given package, listens for answer and manages it
+//Sends given package, waits (blocking the calling task) for the answer and manages it
 uint8_t comm_bidirectionalPackage(comm_msg_t *msg, uint8_t *receivedData, uint8_t max_tries);
 
-// returns true if received new message in ISR
-extern uint8_t comm_receivedMsg(void);
-
-//has to be called after a received message was processed and the master can listen again
-extern void comm_listen(void);
+//Sends the packages (pipelined if possible) and waits for the answers. Returns the amount of answered packages.
+extern uint8_t comm_transferBatch(comm_xfer_t *xfer, uint8_t n, uint8_t max_tries);
 
-//Sends byte to slave
-extern void comm_sendByte(uint8_t byte);
+//Switches to the pipelined protocol if the slave understands it
+extern uint8_t comm_probePipelined(void);
 
 #endif // COMM_API_H
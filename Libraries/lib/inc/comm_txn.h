@@ -0,0 +1,85 @@
+/////////////////////////////////////////////////////////////////////////////////
+/// Communication with slave - transaction (request -> answer) state machine
+/////////////////////////////////////////////////////////////////////////////////
+
+#ifndef COMM_TXN_H
+#define COMM_TXN_H
+
+#include <stdint.h>
+#include "comm_api.h"
+
+#define COMM_START			0xAB //Start byte of a package
+#define COMM_START_SEQ		0xAC //Start byte of a package with sequence number (pipelined protocol, see comm_api.c)
+#define COMM_FRAME_MAX		(6 + COMM_BATCH) //Longest package (with sequence number)
+#define COMM_WINDOW			2 //Max. amount of outstanding requests of the pipelined protocol (power of 2)
+
+//State of a transaction
+enum COMM_TXN {
+	COMM_TXN_IDLE, //No transaction started, received bytes are ignored
+	COMM_TXN_BUSY, //Request sent, waiting for the answer
+	COMM_TXN_OK, //Valid answer to the request
+	COMM_TXN_ERROR //Answer with wrong checksum, register or amount of data (the slave answers with register 255 if it got a broken package)
+};
+
+//Outstanding request
+typedef struct {
+	comm_msg_t *req; //Request
+	uint8_t *rx_data; //Data of the answer is written here (max. req->batch bytes, NULL: ignore the data)
+	uint8_t seq; //Sequence number (pipelined protocol)
+	volatile uint8_t state; //COMM_TXN_...
+} comm_txn_t;
+
+//Outstanding requests and the parser of the answers
+typedef struct {
+	comm_txn_t txn[COMM_WINDOW]; //Index: seq & (COMM_WINDOW - 1). Without pipelining only txn[0] is used.
+	uint8_t pipelined; //1: Requests are sent with sequence numbers
+	uint8_t seq_next; //Sequence number of the next request
+
+	comm_txn_t *cur; //Transaction the answer that is received belongs to (NULL: unknown, ignore it)
+	comm_msg_t rx; //Header and checksum of the answer
+	uint16_t rx_sum; //Checksum calculated over the received bytes
+	uint8_t rx_i; //Received data bytes
+	uint8_t sm; //COMM_SM
+} comm_link_t;
+
+//Transport of a link: USART3 with DMA on the robot (comm_api.c), a pty on the PC (tools/subctrl_sim.c)
+typedef struct {
+	void *ctx; //Passed to the functions
+	//Waits until the last packages are sent, discards the completion signals of
+	//earlier transactions and returns the buffer for the next packages
+	//(COMM_WINDOW * COMM_FRAME_MAX bytes). NULL: Transmitter not free in time.
+	uint8_t *(*tx_buffer)(void *ctx);
+	//Starts sending the first len bytes of the buffer (returns before they are sent)
+	void (*send)(void *ctx, uint16_t len);
+	//Sleeps until comm_link_rxByte completed a transaction or timeout_ms passed
+	void (*wait)(void *ctx, uint16_t timeout_ms);
+	//Time in ms
+	uint32_t (*time_ms)(void *ctx);
+} comm_port_t;
+
+//Writes the package into buf (COMM_FRAME_MAX bytes) and returns its length.
+//seq < 0: Package without sequence number (original protocol)
+extern uint8_t comm_txn_frame(comm_msg_t *msg, int16_t seq, uint8_t *buf);
+
+//Starts a transaction (call before the request is sent). Returns it, so that the
+//request can be sent with its sequence number. Without pipelining only one
+//transaction may be outstanding.
+extern comm_txn_t *comm_link_start(comm_link_t *link, comm_msg_t *req, uint8_t *rx_data, uint8_t pipelined);
+
+//Passes a received byte to the link (receive interrupt). Returns 1 if a
+//transaction completed with this byte (state is COMM_TXN_OK or COMM_TXN_ERROR).
+extern uint8_t comm_link_rxByte(comm_link_t *link, uint8_t byte);
+
+//Stops all transactions (timeout), answers to them are ignored. The parser
+//waits for the next start byte again (the answer may have been truncated).
+extern void comm_link_abort(comm_link_t *link);
+
+//Sends the messages over the port and waits for the answers (see comm_transferBatch).
+//Returns the amount of answered messages.
+extern uint8_t comm_link_transfer(comm_link_t *link, const comm_port_t *port, uint8_t pipelined, comm_xfer_t *xfer, uint8_t n, uint8_t max_tries);
+
+//Reads the status register with a sequence number. Returns 1 if the slave
+//answered, i.e. understands the pipelined protocol.
+extern uint8_t comm_link_probe(comm_link_t *link, const comm_port_t *port);
+
+#endif // COMM_TXN_H
@@ -4,6 +4,7 @@
 #include "stm32f4xx_conf.h"
 #include <stdarg.h>
 #include "main.h"
+#include "binlog.h"
 
 // Maximum string size allocation (in bytes)
 #define MAX_STRING_SIZE     512
@@ -13,8 +14,23 @@ typedef struct {
 	u8 textcolor; //VT100 terminal command colors
 	u8 bgcolor;
 	int8_t (*put_c)(char c); //Called if next char of given stream is processed
+	void (*put_block)(const void *data, u_int16_t len); //Called for a block of data (optional, otherwise put_c is used for every char)
+	u_int32_t suppressed; //Amount of messages that were not formatted because the stream was inactive
 } stream_t;
 
+//Log levels of OUT_LOG/OUT_BLOG
+#define OUT_LVL_ERROR		0
+#define OUT_LVL_WARN		1
+#define OUT_LVL_INFO		2
+#define OUT_LVL_DEBUG		3
+#define OUT_LVL_TRACE		4
+
+//Messages above this level are removed by the compiler, including the
+//calculation of their arguments (set by the Makefile, LOG_LEVEL)
+#ifndef OUT_LOG_LEVEL
+	#define OUT_LOG_LEVEL	OUT_LVL_DEBUG
+#endif
+
 extern stream_t slamUI;
 extern stream_t strlidar;
 extern stream_t debug;
@@ -39,6 +55,29 @@ extern signed int soutf(char *pStr, const char *pFormat, ...);
 
 extern void out_puts_l(stream_t *pStream, const char *pStr, u_int32_t len);
 
+extern void out_binlog(stream_t *pStream, u_int8_t id, u_int8_t n, const int32_t *args);
+
+//Binary log message (id and format: see binlog.h), e.g. boutf(&debug, LOG_SLAM_MATCH, a, b, c).
+//The arguments are converted to int32_t, their amount is counted at compile time.
+#define boutf(pStream, id, ...)	out_binlog((pStream), (id), sizeof((int32_t []){__VA_ARGS__}) / sizeof(int32_t), (const int32_t []){__VA_ARGS__})
+
+//Log message of the given level, e.g. OUT_LOG(OUT_LVL_DEBUG, &debug, "x: %i\n", x). If the
+//stream is inactive, the arguments are not evaluated and only pStream->suppressed is counted.
+#define OUT_LOG(level, pStream, ...)	do { \
+		if((level) <= OUT_LOG_LEVEL) { \
+			if((pStream)->active) foutf((pStream), __VA_ARGS__); \
+			else (pStream)->suppressed ++; \
+		} \
+	} while(0)
+
+//Same for a binary log message (boutf)
+#define OUT_BLOG(level, pStream, id, ...)	do { \
+		if((level) <= OUT_LOG_LEVEL) { \
+			if((pStream)->active) boutf((pStream), (id), __VA_ARGS__); \
+			else (pStream)->suppressed ++; \
+		} \
+	} while(0)
+
 extern signed int out_n_fputc(signed int c);
 
 extern signed int out_fputs(const char *pStr, stream_t *pStream);
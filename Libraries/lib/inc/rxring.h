@@ -0,0 +1,47 @@
+/////////////////////////////////////////////////////////////////////////////////
+/// Receive ring - consumer side of a circular (DMA) receive buffer
+/////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RXRING_H
+#define RXRING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+//Returns the current write position of the producer in the buffer (0...size-1),
+//e.g. size - NDTR of a DMA stream in circular mode or the write index of a
+//simulated byte source.
+typedef u_int16_t (*rxring_head_t)(void *ctx);
+
+typedef struct {
+	u_int8_t *buf; //Buffer the producer writes into
+	u_int16_t size; //Size of buf in bytes (power of 2, so that the absolute positions stay valid when they overflow)
+	rxring_head_t head; //Write position of the producer
+	void *ctx; //Argument of head()
+	volatile u_int32_t wraps; //Amount of complete buffer runs of the producer (rxring_wrapped)
+	u_int32_t consumed; //Amount of bytes the consumer took out of the ring (absolute byte position)
+	u_int32_t overruns; //Amount of times the producer overtook the consumer
+} rxring_t;
+
+extern void rxring_init(rxring_t *ring, u_int8_t *buf, u_int16_t size, rxring_head_t head, void *ctx);
+
+//Producer: Called every time the producer restarts at the beginning of the buffer (DMA transfer complete interrupt)
+extern void rxring_wrapped(rxring_t *ring);
+
+//Absolute amount of bytes written by the producer
+extern u_int32_t rxring_produced(rxring_t *ring);
+
+//Amount of bytes that can be read. If the producer overtook the consumer, the
+//data is dropped (overruns is incremented) and 0 is returned.
+extern u_int16_t rxring_available(rxring_t *ring);
+
+//Pointer to the next unread byte and amount of bytes that can be read from there without wrapping
+extern u_int16_t rxring_contiguous(rxring_t *ring, u_int8_t **ptr);
+
+//Byte at offset from the read position (offset < rxring_available)
+extern u_int8_t rxring_peek(rxring_t *ring, u_int16_t offset);
+
+//Marks n bytes as read
+extern void rxring_consume(rxring_t *ring, u_int16_t n);
+
+#endif // RXRING_H
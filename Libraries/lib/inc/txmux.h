@@ -0,0 +1,51 @@
+/////////////////////////////////////////////////////////////////////////////////
+/// Transmit multiplexer - several prioritized channels on one link
+/////////////////////////////////////////////////////////////////////////////////
+
+#ifndef TXMUX_H
+#define TXMUX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "txring.h"
+
+//Frame: [TXMUX_SYNC][channel][length][data (length bytes)][checksum]
+//Checksum: Sum of channel, length and data (8 bit)
+//The data is not escaped, TXMUX_SYNC can also appear in it (binary channels).
+//A receiver that rejects a frame (checksum, length) resumes the search for
+//TXMUX_SYNC at the byte after the rejected one (see tools/binlog_decode.c).
+#define TXMUX_SYNC			0xFD
+#define TXMUX_PAYLOAD_MAX	128 //Max. data per frame. An urgent channel waits at most for one of these frames (~3ms at 460800 baud).
+#define TXMUX_FRAME_MAX		(TXMUX_PAYLOAD_MAX + 4)
+
+typedef struct {
+	txring_t ring; //Data of the channel that waits to be sent
+	u_int8_t prio; //Priority (0: highest). Channels with the same priority: The one with the lower id first
+	u_int16_t rate; //Max. average data rate in bytes per ms (0: not limited)
+	int32_t burst; //Max. amount of bytes that can be sent at once after a pause (rate limit)
+	int32_t credit; //Amount of bytes the channel may send now (rate limit)
+	u_int32_t sent; //Amount of bytes sent
+} txmux_ch_t;
+
+typedef struct {
+	txmux_ch_t *ch; //Channels, index: channel id
+	u_int8_t n; //Amount of channels
+} txmux_t;
+
+extern void txmux_init(txmux_t *mux, txmux_ch_t *ch, u_int8_t n);
+
+//Configures a channel. buf: Its ring buffer (size: power of 2)
+extern void txmux_channel(txmux_t *mux, u_int8_t id, u_int8_t *buf, u_int16_t size, u_int8_t prio, u_int16_t rate, u_int16_t burst);
+
+//Producer side of the channels: see txring_put_block
+#define txmux_put(mux, id, data, len)	txring_put_block(&(mux)->ch[id].ring, (data), (len))
+
+//Consumer: Refills the credits of the rate limited channels (call every ms)
+extern void txmux_tick(txmux_t *mux, u_int16_t ms);
+
+//Consumer: Writes the next frame (channel with the highest priority that has
+//data and credit left) into frame (TXMUX_FRAME_MAX bytes). Returns its length
+//(0: nothing to send).
+extern u_int16_t txmux_frame(txmux_t *mux, u_int8_t *frame);
+
+#endif // TXMUX_H
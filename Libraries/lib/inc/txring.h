@@ -0,0 +1,35 @@
+/////////////////////////////////////////////////////////////////////////////////
+/// Transmit ring - single producer/single consumer buffer
+/////////////////////////////////////////////////////////////////////////////////
+
+#ifndef TXRING_H
+#define TXRING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct {
+	u_int8_t *buf; //Buffer
+	u_int16_t size; //Size of buf in bytes (power of 2, so that the absolute positions stay valid when they overflow)
+	volatile u_int32_t head; //Absolute amount of bytes put into the ring (only written by the producer)
+	volatile u_int32_t tail; //Absolute amount of bytes sent (only written by the consumer)
+	u_int32_t dropped; //Amount of blocks that did not fit (producer)
+} txring_t;
+
+extern void txring_init(txring_t *ring, u_int8_t *buf, u_int16_t size);
+
+//Producer: Free space in bytes
+extern u_int16_t txring_free(txring_t *ring);
+
+//Producer: Copies the block into the ring. Either the complete block is put
+//or nothing (dropped is incremented). Returns the amount of bytes put.
+extern u_int16_t txring_put_block(txring_t *ring, const void *data, u_int16_t len);
+
+//Consumer: Amount of bytes in the ring
+extern u_int16_t txring_used(txring_t *ring);
+
+//Consumer: Copies up to max bytes out of the ring into dst and frees their
+//space. Returns the amount of bytes copied.
+extern u_int16_t txring_get(txring_t *ring, u_int8_t *dst, u_int16_t max);
+
+#endif // TXRING_H
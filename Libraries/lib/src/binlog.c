@@ -0,0 +1,42 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// binlog.c - Binary log frames
+///
+/// Instead of formatting a message on the robot, only the id of its format
+/// (binlog.h) and the raw arguments are sent. The text is created on the PC by
+/// tools/binlog_decode.c. There is no hardware access in here.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include "binlog.h"
+
+static u_int8_t *binlog_put32(u_int8_t *p, u_int32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+
+	return p + 4;
+}
+
+u_int8_t binlog_pack(u_int8_t *buf, u_int32_t t, u_int8_t id, u_int8_t n, const int32_t *args)
+{
+	u_int8_t *p = buf;
+	u_int8_t chk = 0;
+
+	if(n > BINLOG_ARGS_MAX)
+		n = BINLOG_ARGS_MAX;
+
+	*p++ = BINLOG_START0;
+	*p++ = BINLOG_START1;
+	*p++ = id;
+	*p++ = n;
+	p = binlog_put32(p, t);
+	for(u_int8_t i = 0; i < n; i++)
+		p = binlog_put32(p, args[i]);
+
+	for(u_int8_t *c = &buf[2]; c < p; c++)
+		chk += *c;
+	*p++ = chk;
+
+	return p - buf;
+}
@@ -6,6 +6,13 @@
 ///		Slave antwortet genau so. Bei fehlerhaftem Paket antwortet der Slave mit batch = 0 und Register = 255.
 ///		Batch: Bit 0..6: Batchlänge, Bit 7: Write access
 ///
+///	Erweiterung (Pipelining):
+///		<Startbyte 0xAC><Sequenznummer><Register/Command><Batchlength n>(n*<Data>)<Checksumme1><Checksumme2> -> 6 + n Byte pro Paket
+///		Checksumme inkl. Sequenznummer. Der Slave antwortet mit derselben Sequenznummer, so können bis zu
+///		COMM_WINDOW Anfragen gleichzeitig unterwegs sein (z.B. Motor schreiben und Encoder lesen).
+///		Ein Slave ohne die Erweiterung ignoriert diese Pakete -> comm_probePipelined schaltet dann auf
+///		das ursprüngliche Protokoll zurück.
+///
 ///	Register/Command:
 /// 0			Status (succeed/error)
 /// 1			DIST_BACK_RIGHT LSB
@@ -63,18 +70,26 @@
 ///
 ////////////////////////////////////////////////////////////////////////////////
 
+#include "FreeRTOS.h"
+#include "semphr.h"
+
 #include "stm32f4xx.h"
 #include "stm32f4_discovery.h"
 #include "stm32f4xx_conf.h"
 #include "main.h"
 #include "comm_api.h"
+#include "comm_txn.h"
 #include "outf.h"
 
-comm_msg_t receivedMessage;
-uint8_t messageBuffer[COMM_BUFSIZE];
-comm_msg_t sendMessage;
+static comm_link_t comm_link; //Outstanding transactions, completed by the receive interrupt
+static SemaphoreHandle_t comm_txnDone; //Given by the receive interrupt when an answer of the slave is complete
+static uint8_t comm_pipelined = 0; //1: The slave understands the pipelined protocol (see comm_probePipelined)
+
+static uint8_t comm_txBuf[COMM_WINDOW * COMM_FRAME_MAX]; //Packages that are sent by the DMA
+static SemaphoreHandle_t comm_txDone; //Given by the DMA transfer complete interrupt (comm_txBuf is free again)
 
-uint8_t waitForResponse = 0; //Has to be set to 1 if a package was sent and the master now waits for a response.
+static uint8_t comm_rxBuf[COMM_RXBUF_SIZE]; //Written by the DMA in circular mode
+static uint16_t comm_rxTail = 0; //Next byte of comm_rxBuf to pass to the transaction
 
 ////////////////////////////////////////////////////////////////////////
 /// \brief comm_init
@@ -93,6 +108,7 @@ void comm_init(void)
 	GPIO_InitTypeDef GPIO_InitStructure; // this is for the GPIO pins used as TX and RX
 	USART_InitTypeDef USART_InitStruct; // this is for the USART3 initilization
 	NVIC_InitTypeDef NVIC_InitStructure; // this is used to configure the NVIC (nested vector interrupt controller)
+	DMA_InitTypeDef DMA_InitStructure;
 
 	/* enable APB2 peripheral clock for USART3
 	 * note that only USART1 and USART6 are connected to APB2
@@ -134,134 +150,224 @@ void comm_init(void)
 	USART_Init(USART3, &USART_InitStruct);					// again all the properties are passed to the USART_Init function which takes care of all the bit setting
 
 
-	/* Here the USART3 receive interrupt is enabled
-	 * and the interrupt controller is configured
-	 * to jump to the USART3_IRQHandler() function
-	 * if the USART3 receive interrupt occurs
+	comm_txnDone = xSemaphoreCreateBinary();
+	comm_txDone = xSemaphoreCreateBinary();
+	xSemaphoreGive(comm_txDone); //Nothing sent yet
+	comm_link_abort(&comm_link);
+
+	/* Both directions use the DMA, so the CPU only handles a few
+	 * interrupts per package instead of every byte:
+	 * USART3 RX is DMA1 Stream1 Channel4 in circular mode, the
+	 * idle line (end of the answer), half transfer and transfer
+	 * complete interrupts pass the new bytes to the transaction.
+	 * USART3 TX is DMA1 Stream3 Channel4, started for every
+	 * package (comm_sendPackage).
 	 */
-	USART_ITConfig(USART3, USART_IT_RXNE, ENABLE); // enable the USART3 receive interrupt
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1, ENABLE);
+
+	DMA_DeInit(DMA1_Stream1);
+	DMA_InitStructure.DMA_Channel = DMA_Channel_4;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) &USART3->DR;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t) comm_rxBuf;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMA_InitStructure.DMA_BufferSize = COMM_RXBUF_SIZE;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+	DMA_Init(DMA1_Stream1, &DMA_InitStructure);
+
+	DMA_DeInit(DMA1_Stream3);
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t) comm_txBuf;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+	DMA_InitStructure.DMA_BufferSize = 1; //Set for every package
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_Init(DMA1_Stream3, &DMA_InitStructure);
+
+	DMA_ITConfig(DMA1_Stream1, DMA_IT_HT | DMA_IT_TC, ENABLE);
+	DMA_ITConfig(DMA1_Stream3, DMA_IT_TC, ENABLE);
+	USART_DMACmd(USART3, USART_DMAReq_Rx | USART_DMAReq_Tx, ENABLE);
+	DMA_Cmd(DMA1_Stream1, ENABLE);
+
+	USART_ITConfig(USART3, USART_IT_IDLE, ENABLE); // enable the USART3 idle line interrupt
 
 	NVIC_InitStructure.NVIC_IRQChannel = USART3_IRQn;		 // we want to configure the USART3 interrupts
-	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;// this sets the priority group of the USART3 interrupts
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = (configMAX_SYSCALL_INTERRUPT_PRIORITY >> 4) + 1;// this sets the priority group of the USART3 interrupts (has to be below the FreeRTOS API limit, the interrupt gives comm_txnDone)
 	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;		 // this sets the subpriority inside the group
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;			 // the USART3 interrupts are globally enabled
 	NVIC_Init(&NVIC_InitStructure);							 // the properties are passed to the NVIC_Init function which takes care of the low level stuff
 
+	NVIC_InitStructure.NVIC_IRQChannel = DMA1_Stream1_IRQn; //Same priority as the USART (the receive interrupts must not interrupt each other)
+	NVIC_Init(&NVIC_InitStructure);
+	NVIC_InitStructure.NVIC_IRQChannel = DMA1_Stream3_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+
 	// finally this enables the complete USART3 peripheral
 	USART_Cmd(USART3, ENABLE);
-
-	receivedMessage.data = messageBuffer;
 }
 
 //////////////////////////////////////////////////////////////////
-/// \brief USART3_IRQHandler
-///		listens to the uart and puts a message into a message struct
-///		if receives one
+/// \brief comm_rxISR
+///		Passes the bytes the DMA received since the last call to the
+///		transaction and wakes up the waiting task when the answer is
+///		complete. Only called by the receive interrupts (same priority).
+
+static void comm_rxISR(portBASE_TYPE *woken)
+{
+	uint16_t head = COMM_RXBUF_SIZE - DMA_GetCurrDataCounter(DMA1_Stream1);
+
+	if(head >= COMM_RXBUF_SIZE)
+		head = 0;
 
-static volatile uint8_t comm_sm = 0; //statemachine
+	while(comm_rxTail != head)
+	{
+		if(comm_link_rxByte(&comm_link, comm_rxBuf[comm_rxTail]))
+			xSemaphoreGiveFromISR(comm_txnDone, woken);
 
+		if(++comm_rxTail == COMM_RXBUF_SIZE)
+			comm_rxTail = 0;
+	}
+}
+
+// USART3 interrupt: Only the idle line (end of a package) is used, the data is received by the DMA
 void USART3_IRQHandler(void)
 {
-	if( USART_GetITStatus(USART3, USART_IT_RXNE) )
+	portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
+
+	if(USART_GetITStatus(USART3, USART_IT_IDLE))
 	{
-		static int8_t comm_batch_i = 0;
-
-		/* read UART status register and UART data register */
-		unsigned char data = USART3->DR;
-
-		switch (comm_sm) {
-		case WAITFORPACKAGE:
-			if(data == 0xAB)
-				comm_sm = GET_REGISTER;
-			break;
-		case GET_REGISTER:
-			receivedMessage.reg = data;
-			comm_sm = GET_BATCH;
-			break;
-		case GET_BATCH:
-			receivedMessage.batch = (data & COMM_BATCH);
-			receivedMessage.batch_write = (data & COMM_BATCH_WRITE) >> 7;
-			comm_batch_i = 0;
-
-			if(receivedMessage.batch_write)
-				comm_sm = GET_DATA; //Write access! Write into registers.
-			else
-				comm_sm = GET_CHK_LSB; //The master wants ro read. Continue with checksum.
-
-			break;
-		case GET_DATA: //Master wants to write in registers
-			receivedMessage.data[comm_batch_i] = data;
-			comm_batch_i ++;
-
-			if(comm_batch_i <= receivedMessage.batch)
-				break;
-
-			//no break
-
-		case GET_CHK_LSB: //Checksum LSB
-			receivedMessage.checksum = data << 8;
-			comm_sm = GET_CHK_MSB;
-			break;
-		case GET_CHK_MSB:
-			receivedMessage.checksum |= data;
-			//Received the package. Let the slave process and respond to it!
-			comm_sm = NEWMESSAGE;
-			break;
-		case NEWMESSAGE: break; //BUSY, wait for processing of query. Only listen for new packages if processed and answered.
-		default: comm_sm = WAITFORPACKAGE;
-			break;
-		}
+		(void) USART3->SR; //Clear the idle flag (read SR, then DR)
+		(void) USART3->DR;
+		comm_rxISR(&xHigherPriorityTaskWoken);
 	}
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
 }
 
-//////////////////////////////////////////////////////////////////////////////
-/// \brief comm_calcChecksum
-///		calculates checksum of the given message and returns it (does not save
-///		it into the msg.checksum element!!!)
-/// \param msg
-/// \return checksum
+// DMA half transfer/transfer complete interrupt of the receiver (long answers)
+void DMA1_Stream1_IRQHandler(void)
+{
+	portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
 
-uint16_t comm_calcChecksum(comm_msg_t *msg)
+	if(DMA_GetITStatus(DMA1_Stream1, DMA_IT_TCIF1))
+		DMA_ClearITPendingBit(DMA1_Stream1, DMA_IT_TCIF1);
+	if(DMA_GetITStatus(DMA1_Stream1, DMA_IT_HTIF1))
+		DMA_ClearITPendingBit(DMA1_Stream1, DMA_IT_HTIF1);
+
+	comm_rxISR(&xHigherPriorityTaskWoken);
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
+
+// DMA transfer complete interrupt of the transmitter: The package is in the USART, comm_txBuf is free
+void DMA1_Stream3_IRQHandler(void)
 {
-	uint16_t checksum = 0xAB + msg->reg + ((msg->batch_write << 7) | msg->batch);
-	if(msg->batch_write)
+	portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
+
+	if(DMA_GetITStatus(DMA1_Stream3, DMA_IT_TCIF3))
 	{
-		for(uint8_t i = 0; i < msg->batch; i++)
-		{
-			checksum += msg->data[i];
-		}
+		DMA_ClearITPendingBit(DMA1_Stream3, DMA_IT_TCIF3);
+		xSemaphoreGiveFromISR(comm_txDone, &xHigherPriorityTaskWoken);
 	}
-	return checksum;
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+/// \brief comm_txStart
+///		Starts the DMA with the first len bytes of comm_txBuf (call after
+///		comm_txDone was taken)
+
+static void comm_txStart(uint16_t len)
+{
+	DMA_Cmd(DMA1_Stream3, DISABLE); //Stream is disabled by the hardware after the transfer, this only makes sure
+	while(DMA_GetCmdStatus(DMA1_Stream3) != DISABLE);
+	DMA_ClearFlag(DMA1_Stream3, DMA_FLAG_TCIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_FEIF3);
+	DMA_SetCurrDataCounter(DMA1_Stream3, len);
+	DMA_Cmd(DMA1_Stream3, ENABLE);
 }
 
 /////////////////////////////////////////////////////////////////////////////////
 /// \brief comm_sendPackage
-///		sends the message/the package *msg to the master and also calculates checksum etc.
+///		sends the message/the package *msg to the slave and also calculates checksum etc.
+///		The package is assembled in comm_txBuf and sent by the DMA, the function
+///		returns immediately (it only waits if the last package is still being sent).
 /// \param msg
 ///		message to send
+/// \return
+///		0 if the last package did not finish (DMA problem), otherwise 1
 
-void comm_sendPackage(comm_msg_t *msg)
+uint8_t comm_sendPackage(comm_msg_t *msg)
 {
-	comm_sendByte(0xAB);
-	comm_sendByte(msg->reg);
-	comm_sendByte((msg->batch_write << 7) | msg->batch);
-	if(msg->batch_write)
-	{
-		for(uint8_t i = 0; i < msg->batch; i++)
-		{
-			comm_sendByte(msg->data[i]);
-		}
-	}
-	msg->checksum = comm_calcChecksum(msg);
-	comm_sendByte(msg->checksum >> 8);
-	comm_sendByte(msg->checksum & 0xff);
+	if(!xSemaphoreTake(comm_txDone, COMM_TIMEOUT_MS / portTICK_RATE_MS))
+		return 0;
+
+	comm_txStart(comm_txn_frame(msg, -1, comm_txBuf));
+
+	return 1;
+}
+
+//comm_port_t of USART3: Packages are sent by the DMA, the answers are passed to comm_link by the receive interrupts
+
+static uint8_t *comm_portTxBuffer(void *ctx)
+{
+	(void) ctx;
+
+	while(xSemaphoreTake(comm_txnDone, 0)); //Answers of earlier transactions that came after their timeout
+
+	if(!xSemaphoreTake(comm_txDone, COMM_TIMEOUT_MS / portTICK_RATE_MS))
+		return NULL; //DMA problem
+
+	return comm_txBuf;
+}
+
+static void comm_portSend(void *ctx, uint16_t len)
+{
+	(void) ctx;
+	comm_txStart(len);
+}
+
+static void comm_portWait(void *ctx, uint16_t timeout_ms)
+{
+	(void) ctx;
+	xSemaphoreTake(comm_txnDone, timeout_ms / portTICK_RATE_MS);
+}
+
+static uint32_t comm_portTime(void *ctx)
+{
+	(void) ctx;
+	return xTaskGetTickCount() * portTICK_RATE_MS;
+}
+
+static const comm_port_t comm_port = {NULL, comm_portTxBuffer, comm_portSend, comm_portWait, comm_portTime};
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief comm_transferBatch
+///		Sends the messages and waits for the answers of the slave, pipelined
+///		if the slave understands it (see comm_link_transfer). The receive
+///		interrupt completes the transactions, the task sleeps in the
+///		meantime. Call from a task only!
+/// \param xfer
+///		Messages (and buffers for the answers of read requests). ok is set
+///		to 1 for every message the slave answered.
+/// \param n
+///		Amount of messages
+/// \param max_tries
+/// \return
+///		Amount of messages the slave answered
+
+uint8_t comm_transferBatch(comm_xfer_t *xfer, uint8_t n, uint8_t max_tries)
+{
+	return comm_link_transfer(&comm_link, &comm_port, comm_pipelined, xfer, n, max_tries);
 }
 
 /////////////////////////////////////////////////////////////////////////////
 /// \brief comm_bidirectionalPackage
-///		Sends the given message and also listens for the answer of the slave.
-///		If transmission was unsuccessfully, try to send again maximal max_tries
-///		times.
+///		Sends the given message and waits for the answer of the slave (see
+///		comm_transferBatch). Call from a task only!
 /// \param msg
 ///		Message to send
 /// \param receivedData
@@ -272,102 +378,25 @@ void comm_sendPackage(comm_msg_t *msg)
 
 uint8_t comm_bidirectionalPackage(comm_msg_t *msg, uint8_t *receivedData, uint8_t max_tries)
 {
-	uint8_t tries = 0;
-	uint8_t sm_comm_bidi = 0;
-	uint16_t responseDuration = 0;
+	comm_xfer_t xfer;
 
-	while((tries < max_tries) && (sm_comm_bidi != 3))
-	{
-		switch (sm_comm_bidi) {
-		case 0:
-			comm_listen(); //Activate the listener (has to happen before we send the package)
-			if((!msg->batch_write) && (receivedData != NULL)) //If we want to send a read request, we have to initialize the array in which the slave tranfers the requested data
-				receivedMessage.data = receivedData;
-			comm_sendPackage(msg);
-			responseDuration = 0;
-			sm_comm_bidi = 1;
-		case 1:
-			responseDuration ++;
-			if(responseDuration >= 65000) //No answer from slave... Try to send the message again!
-			{
-				sm_comm_bidi = 0;
-				tries ++;
-			}
-			if(comm_receivedMsg()) //Slave answered
-			{
-				sm_comm_bidi = 2;
-			}
-			break;
-		case 2:
-			if(comm_calcChecksum(&receivedMessage) == receivedMessage.checksum) //Checksum matches, if write access write registers. Sens answer.
-			{
-				if(receivedMessage.reg == msg->reg) //Success!
-					sm_comm_bidi = 3;
-				else //We got an answer, but the register is not matching (probably 254, which is the error register -> The slave wasn’t able to calculate the right checksum). Send again.
-				{
-					sm_comm_bidi = 0;
-					tries ++;
-				}
-			}
-			else //Send last message again
-			{
-				sm_comm_bidi = 0;
-				tries ++;
-			}
-			break;
-		case 3: break; //Succeed
-		default: sm_comm_bidi = 0; tries ++;
-			break;
-		}
-	}
+	xfer.msg = msg;
+	xfer.rx = receivedData;
 
-	/*if(receivedMessage.batch_write) //Master wants to write into slave
-			{
-				for(uint8_t i = 0; i < receivedMessage.batch; i++)
-				{
-					comm_reg[receivedMessage.reg + i] = receivedMessage.data[i];
-				}
-			}*/
-	comm_listen();
-
-	if(tries == max_tries)
-		return 0;
-	else
-		return 1;
+	return comm_transferBatch(&xfer, 1, max_tries);
 }
 
-/////////////////////////////////////////////////////////////////////
-/// \brief comm_receivedMsg
-/// \return
-///		true if received new message in ISR
-
-uint8_t comm_receivedMsg(void)
-{
-	if(comm_sm == NEWMESSAGE)
-		return 1;
-	else
-		return 0;
-}
-
-/////////////////////////////////////////////////////////////////////
-/// \brief comm_listen
+/////////////////////////////////////////////////////////////////////////////
+/// \brief comm_probePipelined
+///		Checks whether the slave understands the pipelined protocol (reads
+///		the status register with a sequence number) and uses it from now
+///		on if so. Call from a task only!
 /// \return
-///		has to be called after a received message was processed and
-///		the master can listen again
+///		1 if the pipelined protocol is used
 
-void comm_listen(void)
+uint8_t comm_probePipelined(void)
 {
-	comm_sm = WAITFORPACKAGE;
-}
+	comm_pipelined = comm_link_probe(&comm_link, &comm_port);
 
-///////////////////////////////////////////////////////////////////////////
-/// \brief comm_sendByte
-///		sends byte to slave
-/// \param byte
-
-void comm_sendByte(uint8_t byte)
-{
-	// wait until data register is empty
-	while( !(USART3->SR & 0x00000040) );
-	USART_SendData(USART3, byte);
+	return comm_pipelined;
 }
@@ -0,0 +1,270 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// comm_txn.c - Transaction state machine of the interface to the subcontroller
+///
+/// Encodes the requests and parses the answers of the slave byte by byte (see the
+/// protocol in comm_api.c). With the pipelined protocol the sequence number of an
+/// answer selects the outstanding transaction it belongs to. The checksum is
+/// summed up while the bytes come in, so the receive interrupt knows at the last
+/// byte whether the transaction succeeded. comm_link_transfer sends the requests,
+/// waits for the answers and sends them again if necessary. There is no hardware
+/// access in here: The transport is a comm_port_t, with a simulated slave behind a
+/// pty (tools/subctrl_sim.c) all of it runs on a PC.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include "comm_txn.h"
+
+#include <stddef.h>
+
+//////////////////////////////////////////////////////////////////////////////
+/// \brief comm_calcChecksum
+///		calculates checksum of the given message and returns it (does not save
+///		it into the msg.checksum element!!!)
+/// \param msg
+/// \return checksum
+
+uint16_t comm_calcChecksum(comm_msg_t *msg)
+{
+	uint16_t checksum = 0xAB + msg->reg + ((msg->batch_write << 7) | msg->batch);
+	if(msg->batch_write)
+	{
+		for(uint8_t i = 0; i < msg->batch; i++)
+		{
+			checksum += msg->data[i];
+		}
+	}
+	return checksum;
+}
+
+uint8_t comm_txn_frame(comm_msg_t *msg, int16_t seq, uint8_t *buf)
+{
+	uint8_t len = 0;
+	uint16_t checksum = 0;
+
+	if(seq < 0)
+		buf[len++] = COMM_START;
+	else
+	{
+		buf[len++] = COMM_START_SEQ;
+		buf[len++] = seq;
+	}
+	buf[len++] = msg->reg;
+	buf[len++] = (msg->batch_write << 7) | msg->batch;
+	if(msg->batch_write)
+		for(uint8_t i = 0; i < msg->batch; i++)
+			buf[len++] = msg->data[i];
+
+	for(uint8_t i = 0; i < len; i++) //Same as comm_calcChecksum (+ the sequence number)
+		checksum += buf[i];
+	msg->checksum = checksum;
+	buf[len++] = msg->checksum >> 8;
+	buf[len++] = msg->checksum & 0xff;
+
+	return len;
+}
+
+comm_txn_t *comm_link_start(comm_link_t *link, comm_msg_t *req, uint8_t *rx_data, uint8_t pipelined)
+{
+	uint8_t seq = pipelined ? link->seq_next++ : 0;
+	comm_txn_t *txn = &link->txn[seq & (COMM_WINDOW - 1)];
+
+	txn->state = COMM_TXN_IDLE; //The interrupt must not work with a half initialized transaction
+	txn->req = req;
+	txn->rx_data = rx_data;
+	txn->seq = seq;
+	link->pipelined = pipelined;
+	txn->state = COMM_TXN_BUSY;
+
+	return txn;
+}
+
+void comm_link_abort(comm_link_t *link)
+{
+	for(uint8_t i = 0; i < COMM_WINDOW; i++)
+		link->txn[i].state = COMM_TXN_IDLE;
+
+	link->cur = NULL;
+	link->sm = WAITFORPACKAGE; //A truncated answer must not swallow the start of the next one
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief comm_link_complete
+///		Checks the answer at its last byte. The answer to a read
+///		request has to contain exactly the requested data (a shorter
+///		one would leave the rest of rx_data stale).
+
+static uint8_t comm_link_complete(comm_link_t *link)
+{
+	comm_txn_t *txn = link->cur;
+
+	link->sm = WAITFORPACKAGE;
+
+	if((txn == NULL) || (txn->state != COMM_TXN_BUSY)) //Answer to an aborted request
+		return 0;
+
+	if((link->rx.checksum == link->rx_sum) && (link->rx.reg == txn->req->reg) &&
+		(txn->req->batch_write || (link->rx.batch_write && (link->rx.batch == txn->req->batch))))
+		txn->state = COMM_TXN_OK;
+	else
+		txn->state = COMM_TXN_ERROR;
+
+	return 1;
+}
+
+uint8_t comm_link_rxByte(comm_link_t *link, uint8_t byte)
+{
+	comm_txn_t *txn = link->cur;
+
+	switch(link->sm)
+	{
+	case WAITFORPACKAGE:
+		link->rx_sum = byte;
+		if(byte == COMM_START_SEQ)
+			link->sm = GET_SEQ;
+		else if(byte == COMM_START)
+		{
+			link->cur = link->pipelined ? NULL : &link->txn[0];
+			link->sm = GET_REGISTER;
+		}
+		break;
+	case GET_SEQ:
+		link->cur = &link->txn[byte & (COMM_WINDOW - 1)];
+		if(link->cur->seq != byte)
+			link->cur = NULL; //Not outstanding (any more)
+		link->rx_sum += byte;
+		link->sm = GET_REGISTER;
+		break;
+	case GET_REGISTER:
+		link->rx.reg = byte;
+		link->rx_sum += byte;
+		link->sm = GET_BATCH;
+		break;
+	case GET_BATCH:
+		link->rx.batch = (byte & COMM_BATCH);
+		link->rx.batch_write = (byte & COMM_BATCH_WRITE) >> 7;
+		link->rx_sum += byte;
+		link->rx_i = 0;
+
+		if(link->rx.batch_write && (link->rx.batch > 0))
+			link->sm = GET_DATA; //Answer contains data
+		else
+			link->sm = GET_CHK_LSB;
+		break;
+	case GET_DATA:
+		if((txn != NULL) && (txn->state == COMM_TXN_BUSY) && (txn->rx_data != NULL) && (link->rx_i < txn->req->batch)) //Never write behind the buffer of the request
+			txn->rx_data[link->rx_i] = byte;
+		link->rx_sum += byte;
+
+		if(++link->rx_i == link->rx.batch)
+			link->sm = GET_CHK_LSB;
+		break;
+	case GET_CHK_LSB: //First (upper) byte of the checksum
+		link->rx.checksum = byte << 8;
+		link->sm = GET_CHK_MSB;
+		break;
+	case GET_CHK_MSB:
+		link->rx.checksum |= byte;
+		return comm_link_complete(link);
+	default:
+		link->sm = WAITFORPACKAGE;
+		break;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+/// \brief comm_link_transfer
+///		Sends the messages and waits for the answers of the slave. With the
+///		pipelined protocol up to COMM_WINDOW requests are sent at once and
+///		their answers are awaited together, otherwise one after the other.
+///		Messages without valid answer within COMM_TIMEOUT_MS are sent again
+///		(max_tries times at most).
+/// \param xfer
+///		Messages (and buffers for the answers of read requests). ok is set
+///		to 1 for every message the slave answered.
+/// \return
+///		Amount of messages the slave answered
+
+uint8_t comm_link_transfer(comm_link_t *link, const comm_port_t *port, uint8_t pipelined, comm_xfer_t *xfer, uint8_t n, uint8_t max_tries)
+{
+	uint8_t window = pipelined ? COMM_WINDOW : 1;
+	uint8_t tries[n];
+	uint8_t answered = 0;
+
+	for(uint8_t i = 0; i < n; i++)
+	{
+		xfer[i].ok = 0;
+		tries[i] = 0;
+	}
+
+	for(;;)
+	{
+		comm_txn_t *txn[COMM_WINDOW];
+		uint8_t idx[COMM_WINDOW];
+		uint8_t k = 0;
+		uint16_t len = 0;
+		uint8_t *buf;
+
+		for(uint8_t i = 0; (i < n) && (k < window); i++) //Next messages to send
+			if(!xfer[i].ok && (tries[i] < max_tries))
+			{
+				tries[i] ++;
+				idx[k++] = i;
+			}
+		if(k == 0)
+			break;
+
+		if((buf = port->tx_buffer(port->ctx)) == NULL)
+			continue; //Last packages still not sent, counts as try
+
+		for(uint8_t j = 0; j < k; j++) //Activate the listeners (has to happen before we send the packages)
+		{
+			comm_msg_t *msg = xfer[idx[j]].msg;
+
+			txn[j] = comm_link_start(link, msg, msg->batch_write ? NULL : xfer[idx[j]].rx, pipelined);
+			len += comm_txn_frame(msg, pipelined ? txn[j]->seq : -1, &buf[len]);
+		}
+		port->send(port->ctx, len);
+
+		uint32_t t_start = port->time_ms(port->ctx);
+		for(;;)
+		{
+			uint8_t busy = 0;
+			uint32_t elapsed = port->time_ms(port->ctx) - t_start;
+
+			for(uint8_t j = 0; j < k; j++)
+				if(txn[j]->state == COMM_TXN_BUSY)
+					busy = 1;
+			if(!busy || (elapsed >= COMM_TIMEOUT_MS))
+				break;
+
+			port->wait(port->ctx, COMM_TIMEOUT_MS - elapsed);
+		}
+
+		for(uint8_t j = 0; j < k; j++)
+			if(txn[j]->state == COMM_TXN_OK)
+			{
+				xfer[idx[j]].ok = 1;
+				answered ++;
+			}
+
+		comm_link_abort(link); //No (valid) answer from slave for the rest... Try to send them again!
+	}
+
+	return answered;
+}
+
+uint8_t comm_link_probe(comm_link_t *link, const comm_port_t *port)
+{
+	comm_msg_t msg;
+	comm_xfer_t xfer;
+	uint8_t status;
+
+	msg.reg = COMM_SYSTEMSTATUS;
+	msg.batch_write = 0;
+	msg.batch = 1;
+	xfer.msg = &msg;
+	xfer.rx = &status;
+
+	return comm_link_transfer(link, port, 1, &xfer, 1, 2);
+}
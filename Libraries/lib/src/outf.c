@@ -10,6 +10,7 @@
  ********************************************************************************/
 #include "stm32f4xx_conf.h"
 #include <stdarg.h>
+#include <string.h>
 #include "outf.h"
 #include "debug.h"
 
@@ -25,54 +26,35 @@ stream_t debugOS;
 stream_t error;
 
 
-//Puts a character directly to the usart (slow, but not basing on queues or interrupts)
+//Puts a character directly to the usart (slow, but not basing on queues or interrupts). Only for the error stream (also used in the fault handlers)
 int8_t usart2_put(char c)
 {
-	USART_SendData(USART2, (uint8_t) c);
-	// Loop until the end of transmission
-	while (USART_GetFlagStatus(USART2, USART_FLAG_TC) == RESET);
+	usart2_putPolled(PCLINK_CH_SYSTEM, &c, 1);
 
 	return c;
 }
 
-//Puts a character to the output queue, which (later) transmit its through the transmit isr. Fast, only for much data/debugging
-int8_t usart2queue_put_spaceErrSent = 0;
-int8_t usart2queue_put_NULLErrSent = 0;
-
-int8_t usart2queue_put(char c)
+static void usart2_putBlockPolled(const void *data, u_int16_t len)
 {
-	if(xQueueTXUSART2 != 0) //If queue was already created
-	{
-		usart2queue_put_NULLErrSent = 0;
-		if(xQueueSendToBack(xQueueTXUSART2, &c, 0)) //character is in queue now
-		{
-			if(USART_GetITStatus (USART2 ,USART_IT_TXE) != SET) //If transmit interrupt is not active, activate it to send data from queue
-				USART_ITConfig(USART2, USART_IT_TXE, ENABLE);
-		}
-		else if(!usart2queue_put_spaceErrSent)
-		{
-			usart2queue_put_spaceErrSent = 1;
-			foutf(&error, "txerr: Queue_SPACE");
-		}
-	}
-	else if(!usart2queue_put_NULLErrSent)
-	{
-		usart2queue_put_NULLErrSent = 1;
-		foutf(&error, "txerr: Queue_NULL");
-	}
+	usart2_putPolled(PCLINK_CH_SYSTEM, data, len);
+}
 
-	if(usart2queue_put_NULLErrSent || usart2queue_put_spaceErrSent) //Instead, put character directly.
-	{
-		usart2_put(c);
+//Put functions of a channel of the PC link: The data is put into the ring of the channel and (later) sent by the DMA
+#define USART2_CHANNEL_PUT(name, ch) \
+	static int8_t usart2_put##name(char c) \
+	{ \
+		usart2_putBlock((ch), &c, 1); \
+		return c; \
+	} \
+	static void usart2_putBlock##name(const void *data, u_int16_t len) \
+	{ \
+		usart2_putBlock((ch), data, len); \
 	}
-	/*
-	if(xQueueSendToBack(xQueueTXUSART2, &c, 0)) //character is in queue now
-	{
-		if(USART_GetITStatus (USART2 ,USART_IT_TXE) != SET) //If transmit interrupt is not active, activate it to send data from queue
-			USART_ITConfig(USART2, USART_IT_TXE, ENABLE);
-	}*/
-	return c;
-}
+
+USART2_CHANNEL_PUT(System, PCLINK_CH_SYSTEM)
+USART2_CHANNEL_PUT(Debug, PCLINK_CH_DEBUG)
+USART2_CHANNEL_PUT(Lidar, PCLINK_CH_LIDAR)
+USART2_CHANNEL_PUT(SlamUI, PCLINK_CH_SLAMUI)
 
 void out_init(void)
 {
@@ -101,27 +83,32 @@ void out_init(void)
 	slamUI.active = 1;
 	slamUI.bgcolor = 0;
 	slamUI.textcolor = 0;
-	slamUI.put_c = &usart2queue_put;
+	slamUI.put_c = &usart2_putSlamUI;
+	slamUI.put_block = &usart2_putBlockSlamUI;
 
 	debug.active = 1;
 	debug.bgcolor = 0;//42; //green
 	debug.textcolor = 0;//30; //black
-	debug.put_c = &usart2queue_put;
+	debug.put_c = &usart2_putDebug;
+	debug.put_block = &usart2_putBlockDebug;
 
 	strlidar.active = 0;
 	strlidar.bgcolor = 0;
 	strlidar.textcolor = 0;
-	strlidar.put_c = &usart2queue_put;
+	strlidar.put_c = &usart2_putLidar;
+	strlidar.put_block = &usart2_putBlockLidar;
 
 	debugOS.active = 1;
 	debugOS.bgcolor = 0;//43; //Yellow
 	debugOS.textcolor = 0;//30; //black
-	debugOS.put_c = &usart2_put;
+	debugOS.put_c = &usart2_putSystem;
+	debugOS.put_block = &usart2_putBlockSystem;
 
 	error.active = 1;
 	error.bgcolor = 0;//41; //red
 	error.textcolor = 0;//30; //black
 	error.put_c = &usart2_put;
+	error.put_block = &usart2_putBlockPolled;
 }
 
 void out_onOff(stream_t *stream, u_int8_t state)
@@ -512,6 +499,12 @@ signed int vfoutf(stream_t *pStream, const char *pFormat, va_list ap)
 	char pStr[MAX_STRING_SIZE];
 	char pError[] = "stdio.c: increase MAX_STRING_SIZE\n";
 
+	if (pStream != NULL && !pStream->active) { //Nothing would be sent, do not format it
+
+		pStream->suppressed ++;
+		return 0;
+	}
+
 	/* Write formatted string in buffer */
 	if (vsoutf(pStr, pFormat, ap) >= MAX_STRING_SIZE) {
 
@@ -575,13 +568,49 @@ signed int soutf(char *pStr, const char *pFormat, ...)
 
 void out_puts_l(stream_t *pStream, const char *pStr, u_int32_t len)
 {
-	for(u_int32_t i = 0; i < len; i++)
+	if(!pStream->active)
+		return;
+
+	if(pStream->put_block != NULL)
+	{
+		while(len > 0)
+		{
+			u_int16_t n = (len > 0xFFFF) ? 0xFFFF : len;
+
+			pStream->put_block(pStr, n);
+			pStr += n;
+			len -= n;
+		}
+	}
+	else if(pStream->put_c != NULL)
 	{
-		if(pStream->put_c != NULL && pStream->active)
+		for(u_int32_t i = 0; i < len; i++)
 			pStream->put_c((char) pStr[i]);
 	}
 }
 
+/**
+ * @brief  Sends a binary log message (see binlog.h) instead of the formatted
+ *         text. Use the boutf macro.
+ *
+ * @param pStream  Output stream.
+ * @param id       Id of the format (BINLOG_MESSAGES).
+ * @param n        Amount of arguments.
+ * @param args     Arguments.
+ */
+void out_binlog(stream_t *pStream, u_int8_t id, u_int8_t n, const int32_t *args)
+{
+	u_int8_t frame[BINLOG_FRAME_MAX];
+
+	if((pStream->put_c == NULL && pStream->put_block == NULL) || !pStream->active)
+	{
+		pStream->suppressed ++;
+		return;
+	}
+
+	out_puts_l(pStream, (const char *) frame, binlog_pack(frame, systemTick, id, n, args));
+}
+
 /**
  * @brief  Implementation of fputs using the DBGU as the standard output. Required
  *         for outf().
@@ -614,7 +643,12 @@ signed int out_fputs(const char *pStr, stream_t *pStream) {
 			out_puts_l(pStream, vt100, 6);
 		}
 
-		while (*pStr != 0)
+		if(pStream->put_block != NULL)
+		{
+			num = strlen(pStr);
+			out_puts_l(pStream, pStr, num);
+		}
+		else while (*pStr != 0)
 		{
 			if(pStream->put_c != NULL)
 			{
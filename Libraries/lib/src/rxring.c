@@ -0,0 +1,99 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// rxring.c - Consumer side of a circular receive buffer
+///
+/// The producer (DMA in circular mode) writes into the buffer on its own, the ring
+/// only knows its write position (head()) and how often it wrapped around
+/// (rxring_wrapped, called from the transfer complete interrupt). From that the
+/// absolute amount of received bytes is calculated, so an overrun of the consumer
+/// can be detected. There is no hardware access in here: With a simulated head()
+/// the ring can be used (and tested) on any machine.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include "rxring.h"
+
+void rxring_init(rxring_t *ring, u_int8_t *buf, u_int16_t size, rxring_head_t head, void *ctx)
+{
+	ring->buf = buf;
+	ring->size = size;
+	ring->head = head;
+	ring->ctx = ctx;
+	ring->wraps = 0;
+	ring->consumed = 0;
+	ring->overruns = 0;
+}
+
+void rxring_wrapped(rxring_t *ring)
+{
+	ring->wraps ++;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief rxring_produced
+///		Absolute amount of bytes the producer wrote. The producer
+///		may wrap between reading wraps and head(): Then head() is
+///		read again.
+///		The DMA restarts at the beginning of the buffer before the
+///		transfer complete interrupt increments wraps. If the consumer
+///		reads in between, head() is already near 0 with the old wraps,
+///		the position would be behind the consumer. The producer can
+///		never be behind the consumer, so then the wrap is pending and
+///		counted here.
+/// \note
+///		The interrupt that calls rxring_wrapped must be able to
+///		preempt the consumer.
+
+u_int32_t rxring_produced(rxring_t *ring)
+{
+	u_int32_t w;
+	u_int16_t h;
+	u_int32_t produced;
+
+	do
+	{
+		w = ring->wraps;
+		h = ring->head(ring->ctx);
+	} while(w != ring->wraps);
+
+	produced = w * ring->size + h;
+	if((int32_t) (produced - ring->consumed) < 0) //Wrapped, but rxring_wrapped not called yet
+		produced += ring->size;
+
+	return produced;
+}
+
+u_int16_t rxring_available(rxring_t *ring)
+{
+	u_int32_t produced = rxring_produced(ring);
+	u_int32_t n = produced - ring->consumed;
+
+	if(n > ring->size) //Old data already overwritten
+	{
+		ring->overruns ++;
+		ring->consumed = produced;
+		return 0;
+	}
+
+	return n;
+}
+
+u_int16_t rxring_contiguous(rxring_t *ring, u_int8_t **ptr)
+{
+	u_int16_t n = rxring_available(ring); //First, because an overrun changes the read position
+	u_int16_t tail = ring->consumed % ring->size;
+
+	*ptr = &ring->buf[tail];
+	if(n > ring->size - tail)
+		n = ring->size - tail;
+
+	return n;
+}
+
+u_int8_t rxring_peek(rxring_t *ring, u_int16_t offset)
+{
+	return ring->buf[(ring->consumed + offset) % ring->size];
+}
+
+void rxring_consume(rxring_t *ring, u_int16_t n)
+{
+	ring->consumed += n;
+}
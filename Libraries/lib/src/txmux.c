@@ -0,0 +1,96 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// txmux.c - Transmit multiplexer
+///
+/// Every channel (output stream) has its own transmit ring, so a channel that
+/// produces a lot of data (e.g. the map for the SlamUI) does not delay the others.
+/// The consumer (transfer complete interrupt of the DMA) always takes the next
+/// frame from the channel with the highest priority that has data. To not let
+/// a busy channel of high priority block the lower ones, it can be limited to
+/// an average data rate (credit refilled by txmux_tick, up to burst). The frames
+/// carry the channel id, so the receiver can separate the channels again
+/// (tools/binlog_decode.c). There is no hardware access in here.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include "txmux.h"
+
+#include <stddef.h>
+
+void txmux_init(txmux_t *mux, txmux_ch_t *ch, u_int8_t n)
+{
+	mux->ch = ch;
+	mux->n = n;
+
+	for(u_int8_t i = 0; i < n; i++)
+		txmux_channel(mux, i, NULL, 0, 0, 0, 0);
+}
+
+void txmux_channel(txmux_t *mux, u_int8_t id, u_int8_t *buf, u_int16_t size, u_int8_t prio, u_int16_t rate, u_int16_t burst)
+{
+	txmux_ch_t *ch = &mux->ch[id];
+
+	txring_init(&ch->ring, buf, size);
+	ch->prio = prio;
+	ch->rate = rate;
+	ch->burst = burst;
+	ch->credit = burst;
+	ch->sent = 0;
+}
+
+void txmux_tick(txmux_t *mux, u_int16_t ms)
+{
+	for(u_int8_t i = 0; i < mux->n; i++)
+	{
+		txmux_ch_t *ch = &mux->ch[i];
+
+		if(ch->rate == 0)
+			continue;
+
+		ch->credit += (int32_t) ch->rate * ms;
+		if(ch->credit > ch->burst)
+			ch->credit = ch->burst;
+	}
+}
+
+u_int16_t txmux_frame(txmux_t *mux, u_int8_t *frame)
+{
+	txmux_ch_t *best = NULL;
+	u_int8_t id = 0;
+	u_int16_t max = TXMUX_PAYLOAD_MAX;
+	u_int16_t len;
+	u_int8_t chk;
+
+	for(u_int8_t i = 0; i < mux->n; i++)
+	{
+		txmux_ch_t *ch = &mux->ch[i];
+
+		if((ch->ring.size == 0) || (txring_used(&ch->ring) == 0) || (ch->rate && (ch->credit <= 0)))
+			continue;
+
+		if((best == NULL) || (ch->prio < best->prio))
+		{
+			best = ch;
+			id = i;
+		}
+	}
+
+	if(best == NULL)
+		return 0;
+
+	if(best->rate && (best->credit < max))
+		max = best->credit;
+
+	len = txring_get(&best->ring, &frame[3], max);
+	best->sent += len;
+	if(best->rate)
+		best->credit -= len;
+
+	frame[0] = TXMUX_SYNC;
+	frame[1] = id;
+	frame[2] = len;
+	chk = id + len;
+	for(u_int16_t i = 0; i < len; i++)
+		chk += frame[3 + i];
+	frame[3 + len] = chk;
+
+	return len + 4;
+}
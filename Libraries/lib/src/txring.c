@@ -0,0 +1,76 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// txring.c - Single producer/single consumer transmit ring
+///
+/// The producer copies whole blocks into the ring and only moves head, the
+/// consumer (e.g. the transfer complete interrupt of the transmit DMA, see
+/// txmux.c) copies the data out and only moves tail. Like that no locking
+/// between the two sides is needed; the producer side itself must not be used
+/// by two tasks at the same time. There is no hardware access in here: With a
+/// simulated drain the ring can be used (and tested) on any machine.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include "txring.h"
+
+#include <string.h>
+
+void txring_init(txring_t *ring, u_int8_t *buf, u_int16_t size)
+{
+	ring->buf = buf;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->dropped = 0;
+}
+
+u_int16_t txring_free(txring_t *ring)
+{
+	return ring->size - (ring->head - ring->tail);
+}
+
+u_int16_t txring_put_block(txring_t *ring, const void *data, u_int16_t len)
+{
+	u_int32_t head = ring->head;
+	u_int16_t pos = head % ring->size;
+	u_int16_t first = ring->size - pos; //Space up to the end of buf
+
+	if(len > txring_free(ring))
+	{
+		ring->dropped ++;
+		return 0;
+	}
+
+	if(first > len)
+		first = len;
+	memcpy(&ring->buf[pos], data, first);
+	memcpy(ring->buf, (const u_int8_t *) data + first, len - first);
+
+	__sync_synchronize(); //Data first, then the new head (the consumer may start sending it right away)
+	ring->head = head + len;
+
+	return len;
+}
+
+u_int16_t txring_used(txring_t *ring)
+{
+	return ring->head - ring->tail;
+}
+
+u_int16_t txring_get(txring_t *ring, u_int8_t *dst, u_int16_t max)
+{
+	u_int32_t tail = ring->tail;
+	u_int16_t pos = tail % ring->size;
+	u_int16_t n = ring->head - tail;
+	u_int16_t first = ring->size - pos; //Bytes up to the end of buf
+
+	if(n > max)
+		n = max;
+	if(first > n)
+		first = n;
+	memcpy(dst, &ring->buf[pos], first);
+	memcpy(dst + first, ring->buf, n - first);
+
+	__sync_synchronize(); //Data first, then the space is given back to the producer
+	ring->tail = tail + n;
+
+	return n;
+}
@@ -7,19 +7,73 @@
 
 #include "main.h"
 #include "slam.h"
+#include "semphr.h"
+#include "comm_api.h"
 
 #define COMM_REGSIZE 53 //In bytes. Size of the register.
+#define COMM_QUEUE_LEN	2 //Max. amount of waiting requests (one per task that writes to the slave)
+#define COMM_TRIES		3 //Max. tries per request (see comm_bidirectionalPackage)
+#define COMM_STALE_PERIODS	4 //Values of the shadow older than this many refresh periods of their group are stale (link dead)
 
-//Handles all queries. To call as often as possible!
-extern void comm_handler(void);
+//Request to the COMM task
+typedef struct {
+	comm_msg_t msg; //Package to send
+	u_int8_t *rx; //Buffer for the answer of a read request (msg.batch bytes)
+	u_int8_t ok; //Result: 1 if the slave answered
+	u_int32_t t_queued; //DWT_CYCCNT when the request was queued
+	SemaphoreHandle_t done; //Given by the COMM task when the request is served
+} comm_request_t;
 
-//Reads out motor data (speed and encoders)
+//Register groups of the shadow (see comm.c)
+enum COMM_GROUP {
+	COMM_GROUP_MOTOR, //Battery, encoders and speeds
+	COMM_GROUP_SENSORS, //Distance sensors
+	COMM_GROUPS
+};
+
+//Group of contiguous registers that is refreshed with one batch read
+typedef struct {
+	u_int8_t first; //First register
+	u_int8_t count; //Amount of registers
+	u_int16_t period_ms; //Refresh period (0: off)
+	u_int32_t t_next; //systemTick of the next refresh
+	volatile u_int32_t stamp; //systemTick of the last successful refresh (0: never)
+	SemaphoreHandle_t refreshed; //Given after every successful refresh (see comm_waitRefresh)
+} comm_group_t;
+
+//Statistics of the link
+typedef struct {
+	u_int32_t served; //Requests served
+	u_int32_t failed; //Requests without valid answer after COMM_TRIES tries
+	u_int32_t busy_cycles; //DWT cycles the link was busy (sending and waiting for the answer)
+	u_int32_t wait_max_cycles; //Longest time a request waited in the queue
+	u_int8_t load; //Utilization of the link in the last second (%, see comm_updateLoad)
+} comm_stats_t;
+
+extern comm_stats_t comm_stats;
+
+//Creates the request queue of the COMM task
+extern void comm_initServer(void);
+
+//Utilization of the link (call once per second)
+extern void comm_updateLoad(void);
+
+//Changes the refresh period of a register group
+extern void comm_setGroupPeriod(u_int8_t group, u_int16_t period_ms);
+
+//Copies registers out of the shadow, returns the time of their refresh (0: never or stale)
+extern u_int32_t comm_readShadow(u_int8_t first, u_int8_t n, u_int8_t *buf);
+
+//Waits for the next refresh of the group
+extern u_int8_t comm_waitRefresh(u_int8_t group, u_int32_t timeout_ms);
+
+//Reads out motor data (speed and encoders) from the shadow, 0 if they are stale
 extern u_int8_t comm_readMotorData(mot_t *mot);
 
 //sets motor speed
 extern u_int8_t comm_setMotor(mot_t *mot);
 
-//reads out battery data
+//reads out battery data from the shadow, 0 if they are stale
 extern u_int8_t comm_readBattData(battstate_t *batt);
 
 #endif // COMM_H
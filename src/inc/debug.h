@@ -13,8 +13,18 @@
 #include "queue.h"
 #include "navigation_api.h"
 #include "slam.h"
-
-extern QueueHandle_t xQueueTXUSART2;
+#include "txmux.h"
+
+//Channels of the PC link (USART2, frames: see txmux.h)
+enum PCLINK_CH {
+	PCLINK_CH_SYSTEM, //error, debugOS
+	PCLINK_CH_DEBUG, //debug
+	PCLINK_CH_LIDAR, //strlidar
+	PCLINK_CH_SLAMUI, //slamUI
+	PCLINK_CHANNELS
+};
+
+extern txmux_t usart2_mux;
 extern QueueHandle_t xQueueRXUSART2;
 
 extern void pcui_sendMsg(char *id, u_int32_t length, char *msg);
@@ -33,5 +43,11 @@ extern void vDebugPrintResetType(void);
 
 void vUSART2_Init(void);
 
+extern void usart2_putBlock(u8 ch, const void *data, u_int16_t len);
+
+extern void usart2_putPolled(u8 ch, const void *data, u_int16_t len);
+
+extern void usart2_txTick(void);
+
 
 #endif /* DEBUG_H_ */
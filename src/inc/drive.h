@@ -5,6 +5,17 @@
 #include "FreeRTOS.h"
 #include "semphr.h"
 
+#define DRIVE_LATENCY_REPORT	25 //Print the latency statistics every x motor commands (~5s)
+
+typedef struct { //Latency from the scan to the motor command in ms
+	u_int32_t min;
+	u_int32_t max;
+	u_int32_t sum;
+	u_int16_t cnt;
+} drive_latency_t;
+
 extern SemaphoreHandle_t driveSync; //Snychronize DRIVE Task with SLAM Task!
 
+extern drive_latency_t drive_latency;
+
 #endif // DRIVE_H
@@ -0,0 +1,22 @@
+#ifndef FLASHREC_H
+#define FLASHREC_H
+
+#include "stm32f4xx.h"
+#include <sys/types.h>
+
+//Flash sector 11 (the last 128KB, not used by the program, see stm32_flash.ld) stores
+//records that have to survive a reset. New records are appended behind the old ones,
+//the sector is only erased when it is full.
+#define FLASHREC_SECTOR			FLASH_Sector_11
+#define FLASHREC_START			0x080E0000
+#define FLASHREC_SIZE			0x20000
+
+#define FLASHREC_MAGIC			0xF1A5 //Upper half of the header word (lower half: length in bytes)
+
+//Copies the newest record into data. Returns 0 if there is no valid record of this length.
+extern u_int8_t flashrec_read(void *data, u_int16_t len);
+
+//Appends the record (erases the sector if it is full). Returns 0 on error.
+extern u_int8_t flashrec_write(const void *data, u_int16_t len);
+
+#endif // FLASHREC_H
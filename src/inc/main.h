@@ -19,6 +19,7 @@ typedef struct { //Battery information
 extern xTaskHandle hTimeTask;
 extern xTaskHandle hDRIVETask;
 extern xTaskHandle hSLAMTask;
+extern xTaskHandle hMAPTask;
 extern xTaskHandle hGuiTask;
 extern xTaskHandle hDebugTask;
 
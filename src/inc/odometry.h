@@ -0,0 +1,33 @@
+#ifndef ODOMETRY_H
+#define ODOMETRY_H
+
+#include "main.h"
+#include "slamdefs.h"
+
+#define ODO_RATE_MS			40 //Sampling period of the encoders (the subcontroller measures the speed with 25Hz)
+#define ODO_HISTORY_LEN		32 //Amount of poses in the history (-> ODO_HISTORY_LEN * ODO_RATE_MS ms)
+
+#define ODO_POS_SHIFT		8 //x/y are stored in mm << ODO_POS_SHIFT
+#define ODO_TICKS_PER_TURN	(WHEELDIST * TICKSPERREV / WHEELRADIUS) //Difference of the encoders (left - right) if the robot turns 360° on the spot (-> 3600: 0.1°/tick)
+#define ODO_MM_PER_TICK_Q16	((int32_t)(2 * WHEELRADIUS * M_PI * 65536 / TICKSPERREV)) //Driven distance per encoder tick in mm << 16
+#define ODO_SIN_SHIFT		14 //Sine table: 1.0 = 1 << ODO_SIN_SHIFT
+
+//Pose of the robot in the odometry frame (Start: 0/0, heading 0 = x axis). Only differences
+//between two poses are meaningful for the SLAM (see odo_delta).
+typedef struct {
+	u_int32_t t; //systemTick of the measurement
+	int32_t x; //mm << ODO_POS_SHIFT
+	int32_t y; //"
+	int32_t heading; //Encoder difference (left - right) in ticks. ODO_TICKS_PER_TURN = 360°, same direction as slam psi.
+} odo_pose_t;
+
+//Latest pose. Returns 0 if there is none yet.
+extern u_int8_t odo_latest(odo_pose_t *pose);
+
+//Pose at the given systemTick (interpolated). Returns 0 if t is not covered by the history (pose is clamped then).
+extern u_int8_t odo_poseAt(u_int32_t t, odo_pose_t *pose);
+
+//Movement between two poses: Driven distance (mm, negative: backwards) and change of psi (degree)
+extern void odo_delta(odo_pose_t *from, odo_pose_t *to, float *dist, float *dpsi);
+
+#endif // ODOMETRY_H
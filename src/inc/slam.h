@@ -5,9 +5,17 @@
 #include "slamdefs.h"
 #include "slam.h"
 #include "xv11.h"
+#include "odometry.h"
 #include "FreeRTOS.h"
+#include "queue.h"
 #include "semphr.h"
 
+#ifndef SLAM_USE_MAPTASK
+	#define SLAM_USE_MAPTASK	1 //1: Integrate the scans in the MAP task (DRIVE gets the new position right after matching), 0: integrate them in the SLAM task
+#endif
+#define SLAM_MAPJOB_SLOTS	2 //Amount of (pose, scan) snapshots that can wait for the MAP task
+#define SLAM_MAPJOB_RAYS	45 //Rays integrated per lock of the map (has to divide LASERSCAN_POINTS and be a multiple of SLAM_MAPINT_STRIDE_PARTIAL)
+
 //Motor information
 typedef struct {
 	int8_t speed_l_is;
@@ -19,13 +27,41 @@ typedef struct {
 	uint8_t driver_standby;
 	int32_t enc_l;
 	int32_t enc_r;
+	u_int32_t enc_stamp; //systemTick when the encoders were read (see comm_readMotorData)
 } mot_t;
 
+//Scan integration job for the MAP task
+typedef struct {
+	slam_position_t pos; //Position of the robot when the scan was matched
+	slam_scan_t scan; //Copy of the (cartesian) scan
+	int16_t quality; //quality of the integration into the raw map (see slam_map_update)
+	u8 stride; //Integrate only every stride-th ray into the raw map (see slam_map_integrationPolicy)
+	u8 nav; //1: Also update the navigation space
+} slam_mapjob_t;
+
+//State of the sector-wise preprocessing of a lidar revolution (see slam_processLaserscan)
+typedef struct {
+	u8 active; //1: A revolution is in progress
+	u_int32_t seq; //Its sequence number
+	int16_t cursor; //Next sensor index to process
+	int16_t cursor_in; //Next sensor index to pass to the scan filter
+	u8 ref_valid; //1: pose_ref is valid and the rays are corrected
+	odo_pose_t pose_ref; //Odometry at the start of the revolution
+} slam_scanprep_t;
+
 extern slam_t slam;
 
 extern mot_t motor;
 
-extern SemaphoreHandle_t lidarSync; //Snychronize SLAM Task with Lidar!
+
+extern u_int32_t slam_scanTime; //systemTick at the end of the newest scan (lidar timestamp)
+extern u_int32_t slam_scansDropped; //Lidar revolutions the SLAM task did not get
+
+#if SLAM_USE_MAPTASK
+extern SemaphoreHandle_t mapMutex; //Lock of the raw map (matching vs. integration)
+
+extern u_int32_t slam_mapJobsDropped;
+#endif
 
 extern void slam_LCD_DispMap(int16_t x0, int16_t y0, float scale, slam_t *slam);
 
@@ -33,6 +69,6 @@ extern void slam_LCD_DispMapNav(int16_t x0, int16_t y0, float scale, slam_t *sla
 
 extern void slam_LCD_DispMapProcessed(int16_t x0, int16_t y0, slam_t *slam);
 
-extern void slam_processLaserscan(slam_t *slam, XV11_t *xv11, float speed_ms);
+extern u8 slam_processLaserscan(slam_t *slam, xv11_sector_t *sector);
 
 #endif // SLAM_H
@@ -8,8 +8,19 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include "stm32f4xx.h"
+
+//DWT cycle counter (not part of the CMSIS version used here). Counts the core clock cycles
+//(168MHz -> overflow after ~25s), so only differences of timestamps are meaningful.
+#define DWT_CTRL				(*((volatile uint32_t *) 0xE0001000))
+#define DWT_CYCCNT				(*((volatile uint32_t *) 0xE0001004))
+#define DWT_CTRL_CYCCNTENA		0x00000001
+#define DWT_CYCLES_PER_MS		(SystemCoreClock / 1000)
+
 void HwInit( void );
 
+void DWT_Init( void );
+
 int16_t *get_sorted(u8 cnt, int16_t *data, u8 get);
 
 #endif /* UTILS_H_ */
@@ -32,36 +32,85 @@ Runtime	V2.6.15295
 
 //Source: http://eliaselectronics.com/stm32f4-tutorials/stm32f4-usart-tutorial/
 
-#define XV11_SPEED_PWM_INIT		180 //MOSFET switches 5V to motor. 8bit PWM: (5/255)*170 ~~ 3.3V (optimal voltage, motor turns approx. with 300RPM)
-#define XV11_SPEED_IREG_INIT	180.0 //Should be (XV11_SPEED_PWM_INIT).0
+#define XV11_SPEED_PWM_INIT		180 //MOSFET switches 5V to motor. 8bit PWM: (5/255)*170 ~~ 3.3V (optimal voltage, motor turns approx. with 300RPM). Feed-forward as long as nothing was learned.
 #define XV11_SPEED_RPM_TO		300.0 //5Hz; Regulate speed to this value
 #define XV11_SPEED_LIM			20.0	//RPM_TO +- Limit: Good results of XV11, otherwise set state to XV11_STARTING
-#define XV11_STATE_ON_CNT		250		//Before the state switches to "XV11_ON", the RPM has to be stable (not unter/above XV11_SPEED_LIM) for n iterations / n*4 measurements
 #define XV11_SPEED_MIN			50.0 //Lowest possible speed value
-#define XV11_SPEED_DIV_I		64.0 //I-Regulator Divisor (the higher the value the inert the regulator)
+#define XV11_SPEED_KP			0.1 //P part of the speed controller (PWM per RPM)
+#define XV11_SPEED_KI			(1 / 64.0) //I part of the speed controller (PWM per RPM and package)
+#define XV11_STABLE_PKTS		80 //The lidar is stable (XV11_ON) if it sent at least this many packages in the last revolution,
+#define XV11_STABLE_STD			5.0 //their speeds have a standard deviation below this (RPM) and their mean is within XV11_SPEED_LIM
+#define XV11_FF_BUCKETS			4 //Feed-forward table: Learned PWM for XV11_SPEED_RPM_TO per battery range (percent)
+#define XV11_FF_SAVE_DIFF		3 //Learned PWM is written into the flash if it differs at least this much from the stored one
 
 #define XV11_PACKAGE_LENGTH 22 //In bytes
 
 #define XV11_VAR_NODATA			0 //Value of distance of the measuement is not usable
 
+#define XV11_PACKAGES			90 //Packages per revolution (4 measurements each)
+#define XV11_SECTORS			4 //A revolution is handed over to the SLAM task in this amount of parts as soon as they are complete (1: only complete revolutions)
+#define XV11_SECTOR(pkg)		((pkg) * XV11_SECTORS / XV11_PACKAGES) //Sector of a package
+#define XV11_SECTOR_FIRST_PKG(sector)	(((sector) * XV11_PACKAGES + XV11_SECTORS - 1) / XV11_SECTORS) //First package of a sector
+#define XV11_SEQ_MASK			0x00FFFFFF //Bits of the sequence number that are handed over with a sector
+
+#define XV11_RXBUF_SIZE			256 //Circular DMA receive buffer in bytes (power of 2). Half of it is received in ~13ms.
+#define XV11_RXEVENTS			16 //Receive interrupts (with timestamp) that are stored (power of 2)
+#define XV11_RX_TIMEOUT_MS		50 //The task checks the buffer at least this often, even without interrupt
+#define XV11_BYTE_CYCLES		(SystemCoreClock / (115200 / 10)) //Duration of one byte (10 bits) in DWT cycles
+
 enum XV11_STATE {
 	XV11_OFF,
 	XV11_STARTING, XV11_ON,
 	XV11_GETSTATE
 };
 
+//One revolution of the lidar. The LIDAR task fills one frame while the other one
+//holds the latest complete revolution (ping-pong), so a scan is never mixed from
+//two revolutions.
+typedef struct {
+	u_int32_t seq; //Number of the revolution (a gap means that revolutions were dropped)
+	u8 sectors; //Amount of sectors that were already handed over to the SLAM task
+	u_int16_t coverage; //Amount of valid measurements in dist_polar
+	u_int16_t bad_pkts; //Packages with wrong checksum in this revolution
+	u_int32_t t_start; //DWT_CYCCNT at the start of the revolution (package 0), 0 if unknown
+	u_int32_t t_start_tick; //systemTick that corresponds to t_start
+	u_int32_t t_end; //DWT_CYCCNT at the end of the revolution (package 0 of the next one)
+	u_int32_t period; //Measured duration of the revolution in cycles (0 if unknown)
+	u_int32_t t_end_tick; //systemTick that corresponds to t_end
+	int16_t dist_polar[360];
+	u_int16_t strength[360]; //Signal strength of the measurements in dist_polar (0 if invalid)
+	u_int32_t pkt_stamp[XV11_PACKAGES]; //DWT_CYCCNT at the start byte of the package that contained dist_polar[i*4...i*4+3], 0 if it was not received
+} xv11_frame_t;
+
 typedef struct {
 	u8 state;
 	float speed;
-	int16_t dist_polar[360];
+	xv11_frame_t frame[2]; //Ping-pong buffer
+	u8 fill; //Frame that is filled by the LIDAR task
+	u8 locked; //Frame that is used by the SLAM task (index + 1, 0: none)
+	u_int32_t rev_cnt; //Amount of completed revolutions
+	u_int32_t frames_dropped; //Revolutions that could not be handed over (SLAM still used the other frame)
+	u_int32_t bad_pkts; //Packages with wrong checksum (total)
+	u_int32_t ready_ms; //Time from switching the motor on until it was stable (last spin-up)
 } XV11_t;
 
 extern volatile XV11_t xv11;
 
-extern QueueHandle_t xQueueLidar;
-
 extern int8_t xv11_state(u8 state);
 
+//Completed part of a revolution
+typedef struct {
+	xv11_frame_t *frame; //Frame of the revolution
+	u8 sector; //0...XV11_SECTORS-1
+	u8 complete; //1: Last sector, the revolution is complete and the frame is locked
+	u_int32_t seq; //Sequence number of the revolution (& XV11_SEQ_MASK)
+} xv11_sector_t;
+
+//Waits for the next completed sector. The frame of the last one is locked until xv11_frameRelease. 0 on timeout.
+extern u8 xv11_sectorTake(xv11_sector_t *sector, portTickType wait);
+
+extern void xv11_frameRelease(void);
+
 extern void xv11_init(void);
 
 #endif // XV11_H
@@ -1,9 +1,23 @@
 //////////////////////////////////////////////////////////////////////////////////////
 /// comm.c - Interface to the Subcontroller
 ///
+/// The COMM task owns the link: The other tasks put their requests into commQueue
+/// and sleep until the COMM task served them, so nobody else touches the link.
+/// Motor commands are put at the front of the queue. A request is sent together
+/// with the due group reads; if the slave supports the pipelined protocol
+/// (comm_probePipelined), up to COMM_WINDOW of them are on the link at once.
 ///
+/// Reading is done by the COMM task on its own: comm_reg is a shadow copy of the
+/// register file of the slave, every group of registers (comm_groups) is
+/// refreshed with one batch read per period. Readers get the latest values from
+/// the shadow (with the time of the refresh) without touching the link.
 ////////////////////////////////////////////////////////////////////////////////
 
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
 #include "stm32f4xx.h"
 #include "stm32f4_discovery.h"
 #include "stm32f4xx_conf.h"
@@ -13,39 +27,263 @@
 #include "slam.h"
 #include "slamdefs.h"
 #include "outf.h"
+#include "utils.h"
 #include "math.h"
+#include <string.h>
+
+static uint8_t comm_reg[COMM_REGSIZE]; //Shadow of the registers of the slave (only accessed in critical sections)
+
+//Register groups, refreshed by the COMM task (see comm_group_t)
+static comm_group_t comm_groups[COMM_GROUPS] = {
+	{COMM_BATTERY_MV_LSB, COMM_MOT_SPEED_R_IS - COMM_BATTERY_MV_LSB + 1, ODO_RATE_MS}, //COMM_GROUP_MOTOR: Battery, encoders and speeds are contiguous -> one read
+	{COMM_DIST_BACK_RIGHT_LSB, COMM_DIST_FRONT_RIGHT_MSB - COMM_DIST_BACK_RIGHT_LSB + 1, 100} //COMM_GROUP_SENSORS: Distance sensors
+};
+
+static xQueueHandle commQueue = NULL; //Pointers to the requests (comm_request_t) for the COMM task
+
+//Every request function has its own request (and is only called by one task)
+static comm_request_t comm_reqSetMotor; //DRIVE task
+
+comm_stats_t comm_stats; //Statistics of the link
+
+//////////////////////////////////////////////////////////////////////
+/// \brief comm_initServer
+///		Creates the request queue (call before the scheduler starts)
+
+void comm_initServer(void)
+{
+	commQueue = xQueueCreate(COMM_QUEUE_LEN, sizeof(comm_request_t *));
+
+	comm_reqSetMotor.done = xSemaphoreCreateBinary();
+
+	for(u8 g = 0; g < COMM_GROUPS; g++)
+		comm_groups[g].refreshed = xSemaphoreCreateBinary();
+}
+
+//////////////////////////////////////////////////////////////////////
+/// \brief comm_transfer
+///		Passes the request to the COMM task and waits until it is served
+/// \param urgent
+///		1: Put it at the front of the queue (motor commands)
+/// \return
+///		1 if the slave answered
+
+static uint8_t comm_transfer(comm_request_t *req, uint8_t urgent)
+{
+	req->t_queued = DWT_CYCCNT;
+
+	if(urgent)
+		xQueueSendToFront(commQueue, &req, portMAX_DELAY);
+	else
+		xQueueSendToBack(commQueue, &req, portMAX_DELAY);
+
+	xSemaphoreTake(req->done, portMAX_DELAY);
+
+	return req->ok;
+}
+
+//////////////////////////////////////////////////////////////////////
+/// \brief comm_updateLoad
+///		Calculates the utilization of the link since the last call (call
+///		once per second)
+
+void comm_updateLoad(void)
+{
+	static u_int32_t busy_last = 0, t_last = 0;
+	u_int32_t busy = comm_stats.busy_cycles, t = DWT_CYCCNT;
+
+	if(t != t_last)
+		comm_stats.load = ((uint64_t)(busy - busy_last) * 100) / (t - t_last);
+
+	busy_last = busy;
+	t_last = t;
+}
+
+//////////////////////////////////////////////////////////////////////
+/// \brief comm_setGroupPeriod
+///		Changes the refresh period of a register group
+/// \param period_ms
+///		0: Do not refresh the group any more
+
+void comm_setGroupPeriod(u8 group, u_int16_t period_ms)
+{
+	comm_groups[group].period_ms = period_ms;
+	comm_groups[group].t_next = systemTick;
+}
+
+//////////////////////////////////////////////////////////////////////
+/// \brief comm_readShadow
+///		Copies registers out of the shadow
+/// \param first
+///		First register
+/// \param n
+///		Amount of registers (all in the same group)
+/// \param buf
+///		Destination
+/// \return
+///		systemTick of the refresh the values are from, 0 if they are stale:
+///		Never refreshed, refresh of the group off or the last refresh is
+///		more than COMM_STALE_PERIODS periods of the group ago (link dead)
 
-static volatile uint8_t comm_reg[COMM_REGSIZE];
+u_int32_t comm_readShadow(u8 first, u8 n, u8 *buf)
+{
+	u_int32_t stamp = 0;
+
+	for(u8 g = 0; g < COMM_GROUPS; g++)
+		if((first >= comm_groups[g].first) && (first < comm_groups[g].first + comm_groups[g].count))
+		{
+			stamp = comm_groups[g].stamp;
+			if((comm_groups[g].period_ms == 0) || ((u_int32_t)(systemTick - stamp) > COMM_STALE_PERIODS * comm_groups[g].period_ms))
+				stamp = 0;
+		}
+
+	taskENTER_CRITICAL();
+	memcpy(buf, &comm_reg[first], n);
+	taskEXIT_CRITICAL();
+
+	return stamp;
+}
 
 //////////////////////////////////////////////////////////////////////
-/// \brief comm_handler
-///		handles the queries from the slave (to call as often as possible)
+/// \brief comm_waitRefresh
+///		Waits until the group is refreshed the next time (only one task
+///		may wait for a group)
+/// \return
+///		1 if the group was refreshed, 0 on timeout
 
-uint8_t comm_handler_sm = 0;
+u8 comm_waitRefresh(u8 group, u_int32_t timeout_ms)
+{
+	return xSemaphoreTake(comm_groups[group].refreshed, timeout_ms / portTICK_RATE_MS);
+}
+
+//////////////////////////////////////////////////////////////////////
+/// \brief comm_serve
+///		Transactions on the link (COMM task only, see comm_transferBatch),
+///		with statistics
 
-void comm_handler(void)
+static void comm_serve(comm_xfer_t *xfer, uint8_t n)
 {
-	comm_reg[0] = 1;
+	u_int32_t t_start = DWT_CYCCNT;
+	uint8_t ok = comm_transferBatch(xfer, n, COMM_TRIES);
+
+	comm_stats.busy_cycles += DWT_CYCCNT - t_start;
+	comm_stats.served += n;
+	comm_stats.failed += n - ok;
+}
+
+///////COMM Task
+/// Serves the requests in commQueue and refreshes the register groups when
+/// they are due. A request and the due groups are sent together, so with
+/// the pipelined protocol e.g. a motor command and the encoder read share
+/// one round trip.
+
+portTASK_FUNCTION( vCOMMTask, pvParameters )
+{
+	comm_request_t *req;
+	comm_xfer_t xfer[1 + COMM_GROUPS];
+	comm_msg_t group_msg[COMM_GROUPS];
+	uint8_t group_rx[COMM_GROUPS][COMM_REGSIZE];
+	uint8_t group_xfer[COMM_GROUPS]; //Index of the group in xfer (0: not due)
+
+	foutf(&debugOS, "xTask COMM started.\n");
+
+	if(comm_probePipelined())
+		foutf(&debugOS, "COMM: Pipelined protocol.\n");
+
+	for(;;)
+	{
+		u_int32_t now = systemTick;
+		u_int32_t wait = portMAX_DELAY;
+		uint8_t n = 0;
+
+		for(u8 g = 0; g < COMM_GROUPS; g++) //Time until the next group is due
+		{
+			if(comm_groups[g].period_ms == 0)
+				continue;
+			if((int32_t)(comm_groups[g].t_next - now) <= 0)
+				wait = 0;
+			else if(comm_groups[g].t_next - now < wait)
+				wait = comm_groups[g].t_next - now;
+		}
+
+		if(xQueueReceive(commQueue, &req, (wait == portMAX_DELAY) ? portMAX_DELAY : (wait / portTICK_RATE_MS)))
+		{
+			if(DWT_CYCCNT - req->t_queued > comm_stats.wait_max_cycles)
+				comm_stats.wait_max_cycles = DWT_CYCCNT - req->t_queued;
+
+			xfer[n].msg = &req->msg; //Requests first (motor commands)
+			xfer[n].rx = req->rx;
+			n ++;
+		}
+		else
+			req = NULL;
+
+		now = systemTick;
+		for(u8 g = 0; g < COMM_GROUPS; g++)
+		{
+			comm_group_t *group = &comm_groups[g];
+
+			group_xfer[g] = 0;
+			if((group->period_ms == 0) || ((int32_t)(group->t_next - now) > 0))
+				continue;
+
+			group->t_next += group->period_ms;
+			if((int32_t)(group->t_next - now) <= 0) //Fell behind: Do not catch up, continue with the period from now on
+				group->t_next = now + group->period_ms;
+
+			group_msg[g].reg = group->first;
+			group_msg[g].batch_write = 0;
+			group_msg[g].batch = group->count;
+			xfer[n].msg = &group_msg[g];
+			xfer[n].rx = group_rx[g];
+			group_xfer[g] = ++n;
+		}
+
+		if(n == 0)
+			continue;
+
+		comm_serve(xfer, n);
+
+		if(req != NULL)
+		{
+			req->ok = xfer[0].ok;
+			xSemaphoreGive(req->done);
+		}
+
+		for(u8 g = 0; g < COMM_GROUPS; g++) //Copy the refreshed groups into the shadow
+		{
+			comm_group_t *group = &comm_groups[g];
+
+			if((group_xfer[g] == 0) || !xfer[group_xfer[g] - 1].ok)
+				continue;
+
+			taskENTER_CRITICAL();
+			memcpy(&comm_reg[group->first], group_rx[g], group->count);
+			group->stamp = systemTick;
+			taskEXIT_CRITICAL();
+
+			xSemaphoreGive(group->refreshed);
+		}
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
 /// \brief comm_readMotorData
-///		Reads the motor data (speed and encoder values) and saves it into
-///		mot
+///		Reads the motor data (speed and encoder values) out of the shadow
+///		and saves it into mot (mot->enc_stamp: time of the refresh)
 /// \param mot
 /// \return
-///		1 if successfully accessed slave, otherwise 0
+///		1 if the values are recent (see comm_readShadow), otherwise 0
+///		(mot is not changed)
 
 u_int8_t comm_readMotorData(mot_t *mot)
 {
-	comm_msg_t speedmsg;
-	//Read 10 registers (Encoder left, Encoder right, speed left, speed right)
-	speedmsg.reg = COMM_MOT_ENC_L_LSB_0;
-	speedmsg.batch_write = 0;
-	speedmsg.batch = 10;
+	//10 registers (Encoder left, Encoder right, speed left, speed right)
 	u_int8_t speedmsg_receive[10];
-	if(comm_bidirectionalPackage(&speedmsg, &speedmsg_receive[0], 3))
+	u_int32_t stamp = comm_readShadow(COMM_MOT_ENC_L_LSB_0, 10, &speedmsg_receive[0]);
+	if(stamp != 0)
 	{
+		mot->enc_stamp = stamp;
 		//succeed!
 		mot->enc_l = (speedmsg_receive[3] << 24) | (speedmsg_receive[2] << 16) | (speedmsg_receive[1] << 8) | speedmsg_receive[0];
 		mot->enc_r = (speedmsg_receive[7] << 24) | (speedmsg_receive[6] << 16) | (speedmsg_receive[5] << 8) | speedmsg_receive[4];
@@ -73,19 +311,20 @@ u_int8_t comm_readMotorData(mot_t *mot)
 
 u_int8_t comm_setMotor(mot_t *mot)
 {
-	comm_msg_t speedmsg;
+	comm_request_t *req = &comm_reqSetMotor;
 	//Write 3 registers (speed left, speed right, driver active)
 	u_int8_t speedmsg_send[3];
 	speedmsg_send[0] = (u_int8_t)mot->speed_l_to;
 	speedmsg_send[1] = (u_int8_t)mot->speed_r_to;
 	speedmsg_send[2] = mot->driver_standby;
 
-	speedmsg.reg = COMM_MOT_SPEED_L_TO;
-	speedmsg.batch_write = 1;
-	speedmsg.batch = 3;
-	speedmsg.data = &speedmsg_send[0];
+	req->msg.reg = COMM_MOT_SPEED_L_TO;
+	req->msg.batch_write = 1;
+	req->msg.batch = 3;
+	req->msg.data = &speedmsg_send[0];
+	req->rx = NULL;
 
-	if(comm_bidirectionalPackage(&speedmsg, NULL, 3))
+	if(comm_transfer(req, 1)) //Motor commands first
 	{
 		return 1;
 	}
@@ -96,22 +335,18 @@ u_int8_t comm_setMotor(mot_t *mot)
 }
 
 //////////////////////////////////////////////////////////////////////////
-/// \brief comm_readMotorData
-///		Reads the motor data (speed and encoder values) and saves it into
-///		mot
-/// \param mot
+/// \brief comm_readBattData
+///		Reads the battery data out of the shadow and saves it into batt
+/// \param batt
 /// \return
-///		1 if successfully accessed slave, otherwise 0
+///		1 if the values are recent (see comm_readShadow), otherwise 0
+///		(batt is not changed)
 
 u_int8_t comm_readBattData(battstate_t *batt)
 {
-	comm_msg_t battmsg;
-	//Read 3 registers (Battery mv (2 reg), Batt % (1reg))
-	battmsg.reg = COMM_BATTERY_MV_LSB;
-	battmsg.batch_write = 0;
-	battmsg.batch = 3;
+	//3 registers (Battery mv (2 reg), Batt % (1reg))
 	u_int8_t battmsg_receive[3];
-	if(comm_bidirectionalPackage(&battmsg, &battmsg_receive[0], 3))
+	if(comm_readShadow(COMM_BATTERY_MV_LSB, 3, &battmsg_receive[0]) != 0)
 	{
 		//succeed!
 		batt->mV = (battmsg_receive[1] << 8) | battmsg_receive[0];
@@ -41,6 +41,7 @@
 
 #include <stdarg.h>
 #include <ctype.h>
+#include <string.h>
 
 #include "FreeRTOS.h"
 #include "task.h"
@@ -62,9 +63,19 @@
 #include "navigation_api.h"
 #include "navigation.h"
 
-QueueHandle_t xQueueTXUSART2;
+txmux_t usart2_mux; //Output of the streams, sent by DMA1 Stream6 (see txmux.c)
+static txmux_ch_t usart2_ch[PCLINK_CHANNELS];
+static u_int8_t usart2_bufSystem[512];
+static u_int8_t usart2_bufDebug[1024];
+static u_int8_t usart2_bufLidar[512];
+static u_int8_t usart2_bufSlamUI[2048];
+static SemaphoreHandle_t usart2_chLock[PCLINK_CHANNELS]; //Only one task may put into a channel at a time
+static u_int8_t usart2_txFrame[TXMUX_FRAME_MAX]; //Frame the DMA is sending (not in the CCM, the DMA can not access it)
+static volatile u8 usart2_txBusy = 0;
 QueueHandle_t xQueueRXUSART2;
 
+static SemaphoreHandle_t pcui_txLock = NULL; //Header and data of a message must not be mixed with another one (DEBUG task and timer)
+
 static void vTimerSendData(TimerHandle_t xTimer);
 u8 timerSendData_sendWPonce = 0; //Send the waypoint list once every time the slam stream is set to active
 
@@ -82,12 +93,10 @@ portTASK_FUNCTION( vDebugTask, pvParameters ) {
 
 	xLastWakeTime = xTaskGetTickCount();
 
-	xQueueTXUSART2 = xQueueCreate( 1500, sizeof(char));
-	if( xQueueTXUSART2 == 0 )
-		foutf(&error, "xQueueTXUSART2 COULD NOT BE CREATED!\n");
 	xQueueRXUSART2 = xQueueCreate( 200, sizeof(char));
 	if( xQueueRXUSART2 == 0 )
 		foutf(&error, "xQueueRXUSART2 COULD NOT BE CREATED!\n");
+	pcui_txLock = xSemaphoreCreateMutex();
 
 	xTimerSendData = xTimerCreate((const char *)"TM_DEB", 50 / portTICK_PERIOD_MS,
 												/* This is a periodic timer, so
@@ -157,16 +166,130 @@ void USART2_IRQHandler(void) //PCUI Receive...
 			xQueueSendToBackFromISR(xQueueRXUSART2, &data, &xHigherPriorityTaskWoken);
 	}
 
-	if((USART_GetFlagStatus(USART2, USART_FLAG_TC) != RESET))// && (USART_GetITStatus (USART2, USART_IT_TXE) != RESET)) //Ready to send next byte and tx interrupt active?
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
+
+/////////////////////////////////////////////////////
+/// \brief usart2_txStart
+///			Starts the DMA with the next frame of usart2_mux if it
+///			is idle (interrupts masked or in the DMA interrupt)
+static void usart2_txStart(void)
+{
+	u_int16_t len;
+
+	if(usart2_txBusy)
+		return;
+
+	len = txmux_frame(&usart2_mux, usart2_txFrame);
+	if(len == 0) //Nothing to send (or only rate limited channels)
+		return;
+
+	usart2_txBusy = 1;
+	DMA_Cmd(DMA1_Stream6, DISABLE); //Stream is disabled by the hardware after the transfer, this only makes sure
+	while(DMA_GetCmdStatus(DMA1_Stream6) != DISABLE);
+	DMA_ClearFlag(DMA1_Stream6, DMA_FLAG_TCIF6 | DMA_FLAG_HTIF6 | DMA_FLAG_TEIF6 | DMA_FLAG_DMEIF6 | DMA_FLAG_FEIF6);
+	DMA_SetCurrDataCounter(DMA1_Stream6, len);
+	DMA_Cmd(DMA1_Stream6, ENABLE);
+}
+
+/////////////////////////////////////////////////////
+/// \brief DMA1_Stream6_IRQHandler
+///			USART2 TX DMA: Frame sent, start the next one
+void DMA1_Stream6_IRQHandler(void)
+{
+	if(DMA_GetITStatus(DMA1_Stream6, DMA_IT_TCIF6))
 	{
-		u_int8_t data;
-		if(xQueueReceiveFromISR(xQueueTXUSART2, &data, &xHigherPriorityTaskWoken)) //Send byte from Queue if available
-			USART_SendData(USART2, data);
-		else
-			USART_ITConfig(USART2, USART_IT_TXE, DISABLE); //otherwise disable tx interrupt
+		DMA_ClearITPendingBit(DMA1_Stream6, DMA_IT_TCIF6);
+		usart2_txBusy = 0;
+		usart2_txStart();
 	}
+}
 
-	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+/////////////////////////////////////////////////////
+/// \brief usart2_txTick
+///			Refills the credits of the rate limited channels and
+///			restarts the DMA if they were waiting (tick hook)
+void usart2_txTick(void)
+{
+	UBaseType_t mask = portSET_INTERRUPT_MASK_FROM_ISR();
+
+	txmux_tick(&usart2_mux, 1);
+	usart2_txStart();
+
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+}
+
+/////////////////////////////////////////////////////
+/// \brief usart2_putBlock
+///			Puts data into the ring of the channel and starts the
+///			DMA. In a task (while the scheduler runs) it waits if the
+///			ring is full, otherwise (interrupt, before the scheduler
+///			runs) the data is dropped.
+void usart2_putBlock(u8 ch, const void *data, u_int16_t len)
+{
+	const u_int8_t *ptr = (const u_int8_t *) data;
+	txring_t *ring = &usart2_mux.ch[ch].ring;
+	u8 wait = (__get_IPSR() == 0) && (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING);
+
+	if(wait)
+		xSemaphoreTake(usart2_chLock[ch], portMAX_DELAY);
+
+	while(len > 0)
+	{
+		u_int16_t n = (len > TXMUX_PAYLOAD_MAX) ? TXMUX_PAYLOAD_MAX : len; //Long blocks in parts, so the interrupts are not masked for long
+		UBaseType_t mask;
+
+		while(wait && (txring_free(ring) < n))
+			vTaskDelay(1); //The DMA sends ~46 bytes/ms
+
+		mask = portSET_INTERRUPT_MASK_FROM_ISR(); //The DMA interrupt may not take the next frame at the same time (and interrupts may put, too)
+		txmux_put(&usart2_mux, ch, ptr, n);
+		usart2_txStart();
+		portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+
+		ptr += n;
+		len -= n;
+	}
+
+	if(wait)
+		xSemaphoreGive(usart2_chLock[ch]);
+}
+
+/////////////////////////////////////////////////////
+/// \brief usart2_putPolled
+///			Sends the data directly as one frame (slow, but works
+///			everywhere, e.g. in the fault handlers). Waits for the
+///			frame the DMA is sending at the moment, the interrupts are
+///			masked until the frame is sent.
+void usart2_putPolled(u8 ch, const void *data, u_int16_t len)
+{
+	const u_int8_t *ptr = (const u_int8_t *) data;
+	u_int8_t hdr[3] = {TXMUX_SYNC, ch, 0};
+
+	while(len > 0)
+	{
+		u_int8_t n = (len > TXMUX_PAYLOAD_MAX) ? TXMUX_PAYLOAD_MAX : len;
+		u_int8_t chk = ch + n;
+		UBaseType_t mask = portSET_INTERRUPT_MASK_FROM_ISR(); //No new DMA frame in between
+
+		while(DMA_GetCmdStatus(DMA1_Stream6) != DISABLE); //Cleared by the hardware at the end of the transfer
+
+		hdr[2] = n;
+		for(u8 i = 0; i < 3 + n + 1; i++)
+		{
+			u_int8_t c = (i < 3) ? hdr[i] : ((i < 3 + n) ? ptr[i - 3] : chk);
+
+			if((i >= 3) && (i < 3 + n))
+				chk += c;
+			USART_SendData(USART2, c);
+			while(USART_GetFlagStatus(USART2, USART_FLAG_TXE) == RESET);
+		}
+		portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+
+		ptr += n;
+		len -= n;
+	}
+	while(USART_GetFlagStatus(USART2, USART_FLAG_TC) == RESET);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -183,25 +306,26 @@ void USART2_IRQHandler(void) //PCUI Receive...
 void pcui_sendMsg(char *id, u_int32_t length, char *msg)
 {
 	int32_t checksum = 0;
-	char len[2];
-	char chk[4];
+	char hdr[17] = "PCUI_MSG"; //Startseq, length, checksum, ID
 
-	len[0] = (char) (length & 0x00ff);
-	len[1] = (char) ((length & 0xff00) >> 8);
+	if(!slamUI.active)
+		return;
 
 	for(u_int32_t i = 0; i < length; i++)
 		checksum += msg[i];
 
-	chk[0] = (char) (checksum & 0x000000ff);
-	chk[1] = (char) ((checksum & 0x0000ff00) >> 8);
-	chk[2] = (char) ((checksum & 0x00ff0000) >> 16);
-	chk[3] = (char) ((checksum & 0xff000000) >> 24);
+	hdr[8] = (char) (length & 0x00ff);
+	hdr[9] = (char) ((length & 0xff00) >> 8);
+	hdr[10] = (char) (checksum & 0x000000ff);
+	hdr[11] = (char) ((checksum & 0x0000ff00) >> 8);
+	hdr[12] = (char) ((checksum & 0x00ff0000) >> 16);
+	hdr[13] = (char) ((checksum & 0xff000000) >> 24);
+	memcpy(&hdr[14], id, 3);
 
-	out_puts_l(&slamUI, "PCUI_MSG", 8); //Startseq
-	out_puts_l(&slamUI, len, 2);
-	out_puts_l(&slamUI, chk, 4);
-	out_puts_l(&slamUI, id, 3);
+	xSemaphoreTake(pcui_txLock, portMAX_DELAY);
+	out_puts_l(&slamUI, hdr, sizeof(hdr));
 	out_puts_l(&slamUI, msg, length);
+	xSemaphoreGive(pcui_txLock);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -223,6 +347,34 @@ void pcui_sendMap(slam_t *slam)
 	/// with the line information and the matching checksum and receive it as message on the pc. If the
 	/// checksum does not matches there, we simply ignore the line and go on.
 
+	/// Columns of tiles that changed (MAP_TILE_DIRTY_PCUI, e.g. new obstacles or decay) are sent first;
+	/// if nothing changed, the lines are sent one after another as before.
+
+	if((sendMap_y % MAP_TILE_SIZE_PX) == 0) //Beginning of a new column of tiles: Jump to the next changed one
+	{
+		int16_t tx = sendMap_y / MAP_TILE_SIZE_PX;
+		for(int16_t n = 0; n < MAP_TILES_Y; n++, tx = (tx + 1) % MAP_TILES_Y)
+		{
+			u8 dirty = 0;
+			taskENTER_CRITICAL(); //The flags are set by the SLAM/MAP task
+			for(int16_t ty = 0; ty < MAP_TILES_X; ty++)
+			{
+				if(slam->map.tile_flags[ty * MAP_TILES_Y + tx] & MAP_TILE_DIRTY_PCUI)
+				{
+					slam->map.tile_flags[ty * MAP_TILES_Y + tx] &= ~MAP_TILE_DIRTY_PCUI;
+					dirty = 1;
+				}
+			}
+			taskEXIT_CRITICAL();
+
+			if(dirty)
+			{
+				sendMap_y = tx * MAP_TILE_SIZE_PX;
+				break;
+			}
+		}
+	}
+
 	mapBuf[0] = sendMap_z; //Current stage to send
 	mapBuf[1] = sendMap_y & 0xff; //Current line to send
 	mapBuf[2] = (sendMap_y & 0xff00) >> 8;
@@ -578,6 +730,7 @@ void vUSART2_Init( void ) {
 	GPIO_InitTypeDef GPIO_InitStructure; // this is for the GPIO pins used as TX and RX
 	USART_InitTypeDef USART_InitStruct; // this is for the USART2 initilization
 	NVIC_InitTypeDef NVIC_InitStructure; // this is used to configure the NVIC (nested vector interrupt controller)
+	DMA_InitTypeDef DMA_InitStructure; // this is for the transmit DMA
 
 	/* enable APB1 peripheral clock for USART2
 	 * note that only USART1 and USART6 are connected to APB2
@@ -626,6 +779,41 @@ void vUSART2_Init( void ) {
 	 */
 	USART_ITConfig(USART2, USART_IT_RXNE, ENABLE); // enable the USART2 receive interrupt
 
+	/* Transmit: DMA1 Stream6 Channel4 sends the frames of usart2_mux
+	 * (normal mode, the length is set for every frame). The system
+	 * messages first, the map for the SlamUI gets what is left.
+	 */
+	txmux_init(&usart2_mux, usart2_ch, PCLINK_CHANNELS);
+	txmux_channel(&usart2_mux, PCLINK_CH_SYSTEM, usart2_bufSystem, sizeof(usart2_bufSystem), 0, 0, 0);
+	txmux_channel(&usart2_mux, PCLINK_CH_DEBUG, usart2_bufDebug, sizeof(usart2_bufDebug), 1, 16, 512); //Max. ~1/3 of the link
+	txmux_channel(&usart2_mux, PCLINK_CH_LIDAR, usart2_bufLidar, sizeof(usart2_bufLidar), 2, 12, 256); //Raw data: ~10 bytes/ms
+	txmux_channel(&usart2_mux, PCLINK_CH_SLAMUI, usart2_bufSlamUI, sizeof(usart2_bufSlamUI), 3, 0, 0);
+	for(u8 i = 0; i < PCLINK_CHANNELS; i++)
+		usart2_chLock[i] = xSemaphoreCreateMutex();
+
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1, ENABLE);
+
+	DMA_DeInit(DMA1_Stream6);
+	DMA_InitStructure.DMA_Channel = DMA_Channel_4;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) &USART2->DR;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t) usart2_txFrame;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+	DMA_InitStructure.DMA_BufferSize = 1; //Set for every frame
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+	DMA_Init(DMA1_Stream6, &DMA_InitStructure);
+
+	DMA_ITConfig(DMA1_Stream6, DMA_IT_TC, ENABLE);
+	USART_DMACmd(USART2, USART_DMAReq_Tx, ENABLE);
+
 
 
 	// Configure the NVIC Preemption Priority Bits
@@ -639,6 +827,9 @@ void vUSART2_Init( void ) {
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
 	NVIC_Init( &NVIC_InitStructure );
 
+	NVIC_InitStructure.NVIC_IRQChannel = DMA1_Stream6_IRQn;
+	NVIC_Init( &NVIC_InitStructure );
+
 	// finally this enables the complete USART2 peripheral
 	USART_Cmd(USART2, ENABLE);
 }
@@ -12,12 +12,41 @@
 
 #include "gui.h"
 #include "outf.h"
+#include "slam.h"
+#include "drive.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 
 SemaphoreHandle_t driveSync; //Snychronize DRIVE Task with SLAM Task!
 
+drive_latency_t drive_latency; //Time from the scan to the motor command (compare SLAM_USE_MAPTASK 0 and 1)
+
+/////////////////////////////////////////////////////////////////
+/// \brief drive_latencyUpdate
+///		Adds the time since the SLAM task took over the scan to the
+///		statistics and prints them every DRIVE_LATENCY_REPORT commands.
+
+static void drive_latencyUpdate(void)
+{
+	u_int32_t latency = systemTick - slam_scanTime;
+
+	if(drive_latency.cnt == 0 || latency < drive_latency.min)
+		drive_latency.min = latency;
+	if(latency > drive_latency.max)
+		drive_latency.max = latency;
+	drive_latency.sum += latency;
+	drive_latency.cnt ++;
+
+	if(drive_latency.cnt >= DRIVE_LATENCY_REPORT)
+	{
+		OUT_LOG(OUT_LVL_DEBUG, &debug, "Scan to motor latency (ms): min: %i, avg: %i, max: %i\n", (int)drive_latency.min, (int)(drive_latency.sum / drive_latency.cnt), (int)drive_latency.max);
+		drive_latency.cnt = 0;
+		drive_latency.sum = 0;
+		drive_latency.max = 0;
+	}
+}
+
 portTASK_FUNCTION( vDRIVETask, pvParameters )
 {
 //	portTickType xLastWakeTime = xTaskGetTickCount();
@@ -34,6 +63,7 @@ portTASK_FUNCTION( vDRIVETask, pvParameters )
 		{
 			navigate(&slam, &motor);
 			comm_setMotor(&motor);
+			drive_latencyUpdate();
 		}
 	}
 }
@@ -0,0 +1,102 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// flashrec.c - Persistent records in the flash
+///
+/// Record: <Header: FLASHREC_MAGIC << 16 | length><Data (padded to words)><Checksum>
+/// The records are written one after the other into FLASHREC_SECTOR. The newest
+/// valid record is the last one before the erased (0xFFFFFFFF) part. Erasing the
+/// sector takes 1-2s in which the CPU is stalled (the program runs from the same
+/// flash bank), so it is only done when there is no space left.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include "stm32f4xx.h"
+#include "stm32f4xx_flash.h"
+#include "flashrec.h"
+
+#include <string.h>
+
+#define FLASHREC_WORDS(len)		(((len) + 3) / 4) //Data words of a record
+
+static u_int32_t flashrec_checksum(const u_int32_t *data, u_int16_t words)
+{
+	u_int32_t chk = 0x5A5A5A5A;
+
+	for(u_int16_t i = 0; i < words; i++)
+		chk = ((chk << 5) | (chk >> 27)) ^ data[i];
+
+	return chk;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief flashrec_find
+///		Searches the end of the written part of the sector
+/// \param last
+///		Start of the last record (or NULL if there is none)
+/// \return
+///		First free address
+
+static u_int32_t flashrec_find(const u_int32_t **last)
+{
+	const u_int32_t *ptr = (const u_int32_t *) FLASHREC_START;
+	const u_int32_t *end = (const u_int32_t *) (FLASHREC_START + FLASHREC_SIZE);
+
+	*last = NULL;
+
+	while((ptr < end) && ((ptr[0] >> 16) == FLASHREC_MAGIC))
+	{
+		*last = ptr;
+		ptr += 2 + FLASHREC_WORDS(ptr[0] & 0xFFFF);
+	}
+
+	return (u_int32_t) ptr;
+}
+
+u_int8_t flashrec_read(void *data, u_int16_t len)
+{
+	const u_int32_t *last;
+
+	flashrec_find(&last);
+	if((last == NULL) || ((last[0] & 0xFFFF) != len))
+		return 0;
+
+	if(last[1 + FLASHREC_WORDS(len)] != flashrec_checksum(&last[1], FLASHREC_WORDS(len))) //Interrupted while writing?
+		return 0;
+
+	memcpy(data, &last[1], len);
+
+	return 1;
+}
+
+u_int8_t flashrec_write(const void *data, u_int16_t len)
+{
+	const u_int32_t *last;
+	u_int32_t buf[FLASHREC_WORDS(len)];
+	u_int32_t addr = flashrec_find(&last);
+	u_int8_t ret = 1;
+
+	memset(buf, 0xFF, sizeof(buf));
+	memcpy(buf, data, len);
+
+	FLASH_Unlock();
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	if((addr + (2 + FLASHREC_WORDS(len)) * 4 > FLASHREC_START + FLASHREC_SIZE) || //Full
+	   (*(const u_int32_t *) addr != 0xFFFFFFFF)) //Garbage behind the last record
+	{
+		if(FLASH_EraseSector(FLASHREC_SECTOR, VoltageRange_3) != FLASH_COMPLETE)
+			ret = 0;
+		addr = FLASHREC_START;
+	}
+
+	if(ret)
+	{
+		ret = (FLASH_ProgramWord(addr, ((u_int32_t) FLASHREC_MAGIC << 16) | len) == FLASH_COMPLETE);
+		for(u_int16_t i = 0; ret && (i < FLASHREC_WORDS(len)); i++)
+			ret = (FLASH_ProgramWord(addr + 4 + i * 4, buf[i]) == FLASH_COMPLETE);
+		if(ret)
+			ret = (FLASH_ProgramWord(addr + 4 + FLASHREC_WORDS(len) * 4, flashrec_checksum(buf, FLASHREC_WORDS(len))) == FLASH_COMPLETE);
+	}
+
+	FLASH_Lock();
+
+	return ret;
+}
@@ -233,6 +233,9 @@ void gui_el_event_btn_clearMap(ELEMENT_EVENT *event)
 			for(u16 y = 0; y < (MAP_SIZE_Y_MM/MAP_RESOLUTION_MM); y++)
 				for(u16 x = 0; x < (MAP_SIZE_X_MM / MAP_RESOLUTION_MM); x ++)
 					slam.map.px[x][y][z] = 127;
+		slam_distmap_init(&slam); //No obstacles anymore
+		for(u16 i = 0; i < (MAP_TILES_X * MAP_TILES_Y); i++)
+			slam.map.tile_flags[i] |= MAP_TILE_DIRTY_LCD | MAP_TILE_DIRTY_PCUI;
 
 		nav_initWaypointStack(); //clear waypoint list
 		nextWP_ID = -1;
@@ -762,7 +765,12 @@ portTASK_FUNCTION( vGUITask, pvParameters )
 
 			if(timer_drawMap == 0)
 			{
-				gui_drawAREAmap(&gui_element[GUI_EL_AREA_MAP]);
+				taskENTER_CRITICAL(); //The flags are set by the SLAM/MAP task
+				u8 map_dirty = slam_map_takeDirty(&slam, MAP_TILE_DIRTY_LCD);
+				taskEXIT_CRITICAL();
+
+				if(map_dirty || show_scan || mapping || processedView) //Only redraw if something changed (map, scan or robot position; the navigation space is not tracked)
+					gui_drawAREAmap(&gui_element[GUI_EL_AREA_MAP]);
 				timer_drawMap = MAP_REFRESHTIME;
 			}
 			timer_drawMap --;
@@ -54,24 +54,33 @@
 
 // Task priorities: Higher numbers are higher priority.
 #define mainTIME_TASK_PRIORITY      ( tskIDLE_PRIORITY + 4 )
+#define mainCOMM_TASK_PRIORITY      ( tskIDLE_PRIORITY + 4 )
 #define mainLIDAR_TASK_PRIORITY       ( tskIDLE_PRIORITY + 3 )
+#define mainODOM_TASK_PRIORITY       ( tskIDLE_PRIORITY + 3 )
 #define mainDRIVE_TASK_PRIORITY       ( tskIDLE_PRIORITY + 2 )
 #define mainSLAM_TASK_PRIORITY       ( tskIDLE_PRIORITY + 2 )
 #define mainGUI_TASK_PRIORITY       ( tskIDLE_PRIORITY + 1 )
+#define mainMAP_TASK_PRIORITY       ( tskIDLE_PRIORITY + 1 )
 #define mainDEBUG_TASK_PRIORITY     ( tskIDLE_PRIORITY + 1 )
 #define mainINTEGER_TASK_PRIORITY   ( tskIDLE_PRIORITY )
 
 xTaskHandle hTimeTask;
 xTaskHandle hDRIVETask;
 xTaskHandle hSLAMTask;
+xTaskHandle hMAPTask;
 xTaskHandle hLIDARTask;
+xTaskHandle hODOMTask;
+xTaskHandle hCOMMTask;
 xTaskHandle hGUITask;
 xTaskHandle hDebugTask;
 
 portTASK_FUNCTION_PROTO( vTimeTask, pvParameters );
 portTASK_FUNCTION_PROTO( vDRIVETask, pvParameters );
 portTASK_FUNCTION_PROTO( vSLAMTask, pvParameters );
+portTASK_FUNCTION_PROTO( vMAPTask, pvParameters );
 portTASK_FUNCTION_PROTO( vLIDARTask, pvParameters );
+portTASK_FUNCTION_PROTO( vODOMTask, pvParameters );
+portTASK_FUNCTION_PROTO( vCOMMTask, pvParameters );
 portTASK_FUNCTION_PROTO( vGUITask, pvParameters );
 portTASK_FUNCTION_PROTO( vDebugTask, pvParameters );
 
@@ -85,11 +94,13 @@ battstate_t battery;
 int main( void )
 {
 	//HwInit();
+	DWT_Init(); //Cycle counter for timestamps
 	out_init();
 		out_onOff(&slamUI, 0); //Unactivate SLAMUI Stream
 	LCD_ResetDevice();
 	UB_Touch_Init();
 	comm_init();
+	comm_initServer();
 	gui_init();
 	vUSART2_Init();
 	xv11_init();
@@ -116,10 +127,18 @@ int main( void )
 			NULL, mainDRIVE_TASK_PRIORITY, &hDRIVETask );
 	xTaskCreate( vSLAMTask, "SLAM",			2024,
 			NULL, mainSLAM_TASK_PRIORITY, &hSLAMTask );
+#if SLAM_USE_MAPTASK
+	xTaskCreate( vMAPTask, "MAP",			512,
+			NULL, mainMAP_TASK_PRIORITY, &hMAPTask );
+#endif
 	xTaskCreate( vGUITask, "GUI",			1024,
 			NULL, mainGUI_TASK_PRIORITY, &hGUITask );
 	xTaskCreate( vLIDARTask, "LIDAR",		1024,
 			NULL, mainLIDAR_TASK_PRIORITY, &hLIDARTask );
+	xTaskCreate( vODOMTask, "ODOM",			512,
+			NULL, mainODOM_TASK_PRIORITY, &hODOMTask );
+	xTaskCreate( vCOMMTask, "COMM",			512,
+			NULL, mainCOMM_TASK_PRIORITY, &hCOMMTask );
 
 	LCD_ResetDevice(); //Reset display here again? Otherwise not working - only a workaround! Still worked at last commit...
 
@@ -163,6 +182,7 @@ portTASK_FUNCTION( vTimeTask, pvParameters ) {
 
 			i = 0;
             u64IdleTicks = u64IdleTicksCnt;
+			comm_updateLoad();
 			u64IdleTicksCnt = 0;
         }
 
@@ -174,6 +194,7 @@ portTASK_FUNCTION( vTimeTask, pvParameters ) {
 // ---------------------------------------------------------------------------- 
 void vApplicationTickHook( void ) {
 	++systemTick;
+	usart2_txTick(); //Rate limits of the PC link
 }
 
 // This FreeRTOS call-back function gets when no other task is ready to execute.
@@ -0,0 +1,232 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// odometry.c - Odometry service
+///
+/// Reads the encoders after every refresh of the register shadow (every ODO_RATE_MS
+/// ms, see comm.c), integrates them (fixed point) to a pose
+/// and stores the poses with their timestamps in a ring buffer. Everyone who needs
+/// the movement of the robot (matching, drive...) can ask for the pose at any time
+/// of the last ODO_HISTORY_LEN * ODO_RATE_MS ms (odo_poseAt) instead of polling the
+/// encoders on its own.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "stm32f4xx.h"
+#include "main.h"
+#include "comm.h"
+#include "slam.h"
+#include "outf.h"
+#include "odometry.h"
+
+#include <math.h>
+
+static odo_pose_t odo_history[ODO_HISTORY_LEN]; //Ring buffer of the poses
+static u_int8_t odo_head = 0; //Next entry to write
+static u_int8_t odo_count = 0; //Amount of valid entries
+
+static int16_t odo_sinTable[92]; //sin(0°...90°) << ODO_SIN_SHIFT (+1 entry for the interpolation)
+
+/////////////////////////////////////////////////////////////////
+/// \brief odo_initSin
+///		Calculates the sine table
+
+static void odo_initSin(void)
+{
+	for(u8 i = 0; i <= 90; i++)
+		odo_sinTable[i] = (int16_t)(sinf(i * (M_PI / 180)) * (1 << ODO_SIN_SHIFT) + 0.5f);
+	odo_sinTable[91] = odo_sinTable[90];
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief odo_sin
+///		Sine of the given heading (linear interpolation between the
+///		degrees of the table)
+/// \param ticks
+///		Heading in encoder ticks (ODO_TICKS_PER_TURN = 360°)
+/// \return
+///		sin << ODO_SIN_SHIFT
+
+static int32_t odo_sin(int32_t ticks)
+{
+	int32_t a, quadrant, i, val;
+
+	ticks %= ODO_TICKS_PER_TURN;
+	if(ticks < 0)
+		ticks += ODO_TICKS_PER_TURN;
+
+	a = (ticks * (360 << 8)) / ODO_TICKS_PER_TURN; //degree << 8
+	quadrant = a / (90 << 8);
+	a -= quadrant * (90 << 8);
+	if(quadrant & 1)
+		a = (90 << 8) - a;
+
+	i = a >> 8;
+	val = odo_sinTable[i] + (((odo_sinTable[i + 1] - odo_sinTable[i]) * (a & 0xff)) >> 8);
+
+	return (quadrant & 2) ? -val : val;
+}
+
+static int32_t odo_cos(int32_t ticks)
+{
+	return odo_sin(ticks + ODO_TICKS_PER_TURN / 4);
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief odo_store
+///		Adds the pose to the history
+
+static void odo_store(odo_pose_t *pose)
+{
+	taskENTER_CRITICAL();
+	odo_history[odo_head] = *pose;
+	if(++odo_head == ODO_HISTORY_LEN)
+		odo_head = 0;
+	if(odo_count < ODO_HISTORY_LEN)
+		odo_count ++;
+	taskEXIT_CRITICAL();
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief odo_latest
+///		Returns the latest pose
+/// \param pose
+///		Pose is saved here
+/// \return
+///		0 if there is no pose yet, otherwise 1
+
+u_int8_t odo_latest(odo_pose_t *pose)
+{
+	u_int8_t ret = 0;
+
+	taskENTER_CRITICAL();
+	if(odo_count > 0)
+	{
+		*pose = odo_history[(odo_head + ODO_HISTORY_LEN - 1) % ODO_HISTORY_LEN];
+		ret = 1;
+	}
+	taskEXIT_CRITICAL();
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief odo_poseAt
+///		Returns the pose at the given time, linearly interpolated
+///		between the two neighbouring measurements.
+/// \param t
+///		systemTick
+/// \param pose
+///		Pose is saved here
+/// \return
+///		1 if t is covered by the history, 0 if it is older than the oldest
+///		or newer than the latest measurement (pose is the oldest/latest one
+///		then) or if there is no pose yet.
+
+u_int8_t odo_poseAt(u_int32_t t, odo_pose_t *pose)
+{
+	odo_pose_t a, b;
+	u_int8_t i, n;
+
+	taskENTER_CRITICAL();
+	if(odo_count == 0)
+	{
+		taskEXIT_CRITICAL();
+		return 0;
+	}
+
+	i = (odo_head + ODO_HISTORY_LEN - 1) % ODO_HISTORY_LEN; //Latest
+	b = odo_history[i];
+	if((int32_t)(t - b.t) >= 0) //Newer than the latest measurement
+	{
+		taskEXIT_CRITICAL();
+		*pose = b;
+		return (t == b.t);
+	}
+
+	for(n = 1; n < odo_count; n++) //Search backwards for the first measurement before t
+	{
+		i = (i + ODO_HISTORY_LEN - 1) % ODO_HISTORY_LEN;
+		a = odo_history[i];
+		if((int32_t)(t - a.t) >= 0)
+			break;
+		b = a;
+	}
+	taskEXIT_CRITICAL();
+
+	if(n == odo_count) //Older than the oldest measurement
+	{
+		*pose = b;
+		return 0;
+	}
+
+	float f = (float)(t - a.t) / (float)(b.t - a.t);
+	pose->t = t;
+	pose->x = a.x + (int32_t)((b.x - a.x) * f);
+	pose->y = a.y + (int32_t)((b.y - a.y) * f);
+	pose->heading = a.heading + (int32_t)((b.heading - a.heading) * f);
+
+	return 1;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief odo_delta
+///		Calculates the movement between two poses
+/// \param from
+/// \param to
+///		Poses
+/// \param dist
+///		Driven distance in mm in the direction of the mean heading
+///		(negative if driven backwards)
+/// \param dpsi
+///		Change of the orientation in degree (same direction as slam psi)
+
+void odo_delta(odo_pose_t *from, odo_pose_t *to, float *dist, float *dpsi)
+{
+	float dx = (float)(to->x - from->x) / (1 << ODO_POS_SHIFT);
+	float dy = (float)(to->y - from->y) / (1 << ODO_POS_SHIFT);
+	int32_t dheading = to->heading - from->heading;
+	float heading_mean = (from->heading + dheading / 2.0f) * (2 * M_PI / ODO_TICKS_PER_TURN);
+
+	*dist = dx * cosf(heading_mean) + dy * sinf(heading_mean);
+	*dpsi = dheading * 360.0f / ODO_TICKS_PER_TURN;
+}
+
+///////ODOM Task
+/// Integrates the encoders to the pose whenever the COMM task read new ones.
+
+portTASK_FUNCTION( vODOMTask, pvParameters )
+{
+	odo_pose_t pose = {0, 0, 0, 0};
+	int32_t enc_l_old = 0, enc_r_old = 0;
+	u_int8_t encValid = 0;
+
+	foutf(&debugOS, "xTask ODOM started.\n");
+
+	odo_initSin();
+
+	for(;;)
+	{
+		if(comm_waitRefresh(COMM_GROUP_MOTOR, 4 * ODO_RATE_MS) && comm_readMotorData(&motor))
+		{
+			if(encValid)
+			{
+				int32_t dl = motor.enc_l - enc_l_old; //Ticks since the last measurement
+				int32_t dr = motor.enc_r - enc_r_old;
+				int32_t dheading = dl - dr;
+				int32_t dist = ((dl + dr) * ODO_MM_PER_TICK_Q16) >> (17 - ODO_POS_SHIFT); //Mean of both wheels (/2) in mm << ODO_POS_SHIFT
+				int32_t heading_mean = pose.heading + dheading / 2; //Arc is approximated by the chord in the mean direction
+
+				pose.x += (int32_t)(((int64_t)dist * odo_cos(heading_mean)) >> ODO_SIN_SHIFT);
+				pose.y += (int32_t)(((int64_t)dist * odo_sin(heading_mean)) >> ODO_SIN_SHIFT);
+				pose.heading += dheading;
+			}
+			enc_l_old = motor.enc_l;
+			enc_r_old = motor.enc_r;
+			encValid = 1;
+
+			pose.t = motor.enc_stamp; //Time of the measurement, not of the integration
+			odo_store(&pose);
+		}
+	}
+}
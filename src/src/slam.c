@@ -1,5 +1,6 @@
 #include "FreeRTOS.h"
 #include "task.h"
+#include "queue.h"
 #include "semphr.h"
 
 #include "stm32f4xx.h"
@@ -19,6 +20,7 @@
 #include "slam.h"
 #include "slamdefs.h"
 #include "drive.h"
+#include "odometry.h"
 
 #include "SSD1963.h"
 #include "SSD1963_api.h"
@@ -33,8 +35,55 @@ mot_t motor; //Motor information (encoder etc.)
 //slam_coordinates_t lidar_lastPosition; //Stores the position of the robot at the beginning of the next lidar scan to calculate the dist the robot has driven.
 
 ///////SLAM Task
-SemaphoreHandle_t lidarSync; //Snychronize SLAM Task with Lidar!
+u_int32_t slam_scanTime; //systemTick at the end of the newest scan (lidar timestamp, see drive latency measurement)
+u_int32_t slam_scansDropped = 0; //Lidar revolutions the SLAM task did not get (gaps in the frame sequence)
+static slam_scanprep_t slam_scanprep; //Preprocessing of the current lidar revolution (see slam_processLaserscan)
 
+static u8 slam_waitForScan(slam_t *slam, xv11_sector_t *sector);
+
+#if SLAM_USE_MAPTASK
+SemaphoreHandle_t mapMutex; //Held by the SLAM task while matching and by the MAP task while writing into the map
+xQueueHandle mapQueue = NULL; //Indices of the filled slots of slam_mapJob, MAP task processes them
+slam_mapjob_t slam_mapJob[SLAM_MAPJOB_SLOTS]; //(pose, scan) snapshots for the MAP task
+volatile u8 slam_mapJobBusy[SLAM_MAPJOB_SLOTS]; //1: slot is queued or in progress. Only set by the SLAM task, only cleared by the MAP task.
+u_int32_t slam_mapJobsDropped = 0; //Scans that were not integrated because the MAP task was too slow
+
+/////////////////////////////////////////////////////////////////
+/// \brief slam_mapJobPost
+///		Copies the current pose and scan into a free slot and passes it to
+///		the MAP task. If both slots are still busy, the scan is dropped (the
+///		next one follows in 200ms).
+/// \param quality
+///		quality of the integration into the raw map
+/// \param stride
+///		Integrate only every stride-th ray into the raw map (see slam_map_integrationPolicy)
+/// \param nav
+///		1: Also update the navigation space
+
+static void slam_mapJobPost(slam_t *slam, int16_t quality, u8 stride, u8 nav)
+{
+	u8 slot;
+
+	for(slot = 0; slot < SLAM_MAPJOB_SLOTS; slot++)
+		if(!slam_mapJobBusy[slot])
+			break;
+
+	if(slot == SLAM_MAPJOB_SLOTS)
+	{
+		slam_mapJobsDropped ++;
+		return;
+	}
+
+	slam_mapJob[slot].pos = slam->robot_pos;
+	slam_mapJob[slot].scan = slam->sensordata.scan;
+	slam_mapJob[slot].quality = quality;
+	slam_mapJob[slot].stride = stride;
+	slam_mapJob[slot].nav = nav;
+
+	slam_mapJobBusy[slot] = 1;
+	xQueueSendToBack(mapQueue, &slot, 0);
+}
+#endif
 
 portTASK_FUNCTION( vSLAMTask, pvParameters ) {
 //	portTickType xLastWakeTime;
@@ -42,26 +91,49 @@ portTASK_FUNCTION( vSLAMTask, pvParameters ) {
 	foutf(&debugOS, "xTask SLAM started.\n");
 
 	//xLastWakeTime = xTaskGetTickCount();
-	lidarSync = xSemaphoreCreateBinary();
+#if SLAM_USE_MAPTASK
+	mapMutex = xSemaphoreCreateMutex();
+	mapQueue = xQueueCreate(SLAM_MAPJOB_SLOTS, sizeof(u8));
+#endif
 
 	nav_initWaypointStack();
 
 	motor.driver_standby = 0;
 
-	comm_readMotorData(&motor); //Important as start value of slam struct .odo_[dir]_old!!
+	odo_pose_t odo_lastScan, odo_scan; //Odometry at the last and the current scan
+	float odo_dist, odo_dpsi;
+	while(!odo_latest(&odo_lastScan)) //Wait for the first measurement of the ODOM task (also important as start value of slam struct .odo_[dir]_old!!)
+		vTaskDelay(ODO_RATE_MS / portTICK_RATE_MS);
+
 	slam_init(&slam, 1000, 1000, 0, 90, &motor.enc_l, &motor.enc_r);
 
 	int32_t monteCarlo_time;
+	u_int32_t scanTime_last = systemTick;
+	u_int32_t scanSeq_last = XV11_SEQ_MASK; //Sequence number of the last lidar revolution
+	xv11_sector_t sector;
+	u8 mapint_stride; //Result of the integration policy
 
 	int16_t monteCarlo_tries = 1300; //standard value. Amount of tries in the montecarlo search. We regulate it to a maximum to keep the general time < 180ms (200ms: new laser scan).
 
 	for(;;)
 	{
-		foutf(&debugOS, "Watermark slam: %i\n", uxTaskGetStackHighWaterMark( NULL ));
+		OUT_LOG(OUT_LVL_TRACE, &debugOS, "Watermark slam: %i\n", uxTaskGetStackHighWaterMark( NULL ));
 
-		if(xSemaphoreTake(lidarSync, portMAX_DELAY) == pdTRUE) //Synchronize Lidar and SLAM integration (only process SLAM Data (Lidar, etc.) if Lidar has turned 360°)
+		if(slam_waitForScan(&slam, &sector)) //Synchronize Lidar and SLAM integration (only process SLAM Data (Lidar, etc.) if Lidar has turned 360°)
 		{
-			slam_processLaserscan(&slam, (XV11_t *) &xv11, (motor.speed_l_ms + motor.speed_r_ms) / 2);
+			if(sector.seq != ((scanSeq_last + 1) & XV11_SEQ_MASK))
+				slam_scansDropped += (sector.seq - scanSeq_last - 1) & XV11_SEQ_MASK;
+			scanSeq_last = sector.seq;
+
+			scanTime_last = slam_scanTime;
+			slam_scanTime = sector.frame->t_end_tick; //Measured end of the revolution
+
+			xv11_frameRelease(); //Everything needed is in slam.sensordata now
+			OUT_BLOG(OUT_LVL_DEBUG, &debug, LOG_SLAM_FILTER, slam.filter.dropped[SLAM_FILTER_CLIP], slam.filter.cycles[SLAM_FILTER_CLIP], slam.filter.cycles[SLAM_FILTER_MEDIAN], slam.filter.dropped[SLAM_FILTER_ISOLATED], slam.filter.cycles[SLAM_FILTER_ISOLATED]);
+
+			odo_poseAt(slam_scanTime, &odo_scan); //Movement since the last scan
+			odo_delta(&odo_lastScan, &odo_scan, &odo_dist, &odo_dpsi);
+			odo_lastScan = odo_scan;
 
 			//lidar_lastPosition = slam.robot_pos.coord;
 
@@ -69,21 +141,38 @@ portTASK_FUNCTION( vSLAMTask, pvParameters ) {
 			{
 				monteCarlo_time = systemTick;
 
-				comm_readMotorData(&motor);
 				int16_t slam_updateVar = abs(motor.speed_l_is - motor.speed_r_is); //Difference of speed. The smaller, the straighter drives the robot.
 
-				slam_processMovement(&slam);
+#if SLAM_USE_MAPTASK
+				xSemaphoreTake(mapMutex, portMAX_DELAY); //The map must not change while matching
+#endif
+				slam_applyMovement(&slam, odo_dist, odo_dpsi);
 
-				int best = 0;
+				int32_t best = 0;
 				best = slam_monteCarloSearch(&slam, 100, 10, monteCarlo_tries);
+#if SLAM_USE_MAPTASK
+				xSemaphoreGive(mapMutex);
+				xSemaphoreGive(driveSync); //New position is known -> DRIVE can go on, the map is integrated by the MAP task in the meantime
+#endif
 
 				if(slam_updateVar < 10)
 					slam_updateVar = 10 - slam_updateVar;
 				else
 					slam_updateVar = 1;
 
-				slam_map_update(&slam, 1, slam_updateVar, 350);//160); //Update map pixels
-				//slam_map_update(&slam, 0, slam_updateVar, 500); //Update navigation space
+				mapint_stride = slam_map_integrationPolicy(&slam, best, slam_scanTime - scanTime_last); //Integrate fully, partially or not at all?
+
+				if(mapint_stride)
+				{
+#if SLAM_USE_MAPTASK
+					slam_mapJobPost(&slam, slam_updateVar, mapint_stride, 0);
+#else
+					slam_map_updateRays(&slam, &slam.robot_pos, &slam.sensordata.scan, 1, slam_updateVar, SLAM_HOLE_WIDTH_MAP, 0, LASERSCAN_POINTS, mapint_stride); //Update map pixels
+					slam_map_decay(&slam, MAP_DECAY_TILES_PER_UPDATE); //Let unconfirmed obstacles fade out
+					slam_distmap_update(&slam, MAP_DISTMAP_TILES_PER_UPDATE); //Update distance map in the changed regions
+					//slam_map_update(&slam, 0, slam_updateVar, SLAM_HOLE_WIDTH_NAV); //Update navigation space
+#endif
+				}
 
 				//montecarlo regulation
 				if(systemTick - monteCarlo_time < 160) //If the time nessesary in this iteration is less than 160ms, increase the montecarlo tries, otherwise decrease it (simple integral regulator)
@@ -93,13 +182,21 @@ portTASK_FUNCTION( vSLAMTask, pvParameters ) {
 
 				//foutf(&debug, "MonteCarlo time needed: %i, new amounts: %i\n", systemTick - monteCarlo_time, monteCarlo_tries);
 
-				foutf(&debug, "time: %i, quality: %i, pos x: %i, pos y: %i, psi: %i, new amounts: %i\n", (int)(systemTick - monteCarlo_time), best, (int)slam.robot_pos.coord.x, (int)slam.robot_pos.coord.y, (int)slam.robot_pos.psi, (int)monteCarlo_tries);
+				OUT_BLOG(OUT_LVL_DEBUG, &debug, LOG_SLAM_MATCH, systemTick - monteCarlo_time, best, slam.robot_pos.coord.x, slam.robot_pos.coord.y, slam.robot_pos.psi, monteCarlo_tries, mapint_stride);
+#if !SLAM_USE_MAPTASK
 				xSemaphoreGive(driveSync);
+#endif
 			}
 			else
 			{
-				slam_map_update(&slam, 1, 100, 350);//160);
-				slam_map_update(&slam, 0, 100, 500);
+#if SLAM_USE_MAPTASK
+				slam_mapJobPost(&slam, 100, 1, 1);
+#else
+				slam_map_update(&slam, 1, 100, SLAM_HOLE_WIDTH_MAP);//160);
+				slam_map_decay(&slam, MAP_DECAY_TILES_PER_UPDATE);
+				slam_distmap_update(&slam, MAP_DISTMAP_TILES_PER_UPDATE);
+				slam_map_update(&slam, 0, 100, SLAM_HOLE_WIDTH_NAV);
+#endif
 				motor.speed_l_to = 0;
 				motor.speed_r_to = 0;
 			}
@@ -108,34 +205,230 @@ portTASK_FUNCTION( vSLAMTask, pvParameters ) {
 	}
 }
 
+#if SLAM_USE_MAPTASK
+///////MAP Task
+/// Integrates the scans posted by the SLAM task into the map. Runs with a lower
+/// priority than SLAM and DRIVE, so the integration only takes the time that is
+/// left until the next scan. The map is locked for SLAM_MAPJOB_RAYS rays at a
+/// time, so the matcher never waits longer than for one chunk.
+
+portTASK_FUNCTION( vMAPTask, pvParameters ) {
+	u8 slot;
+
+	while(mapQueue == NULL) //Wait until the SLAM task created the queue and the mutex
+		vTaskDelay(10 / portTICK_RATE_MS);
+
+	foutf(&debugOS, "xTask MAP started.\n");
+
+	for(;;)
+	{
+		if(xQueueReceive(mapQueue, &slot, portMAX_DELAY) == pdTRUE)
+		{
+			slam_mapjob_t *job = &slam_mapJob[slot];
+
+			for(int16_t i = 0; i < LASERSCAN_POINTS; i += SLAM_MAPJOB_RAYS)
+			{
+				xSemaphoreTake(mapMutex, portMAX_DELAY);
+				slam_map_updateRays(&slam, &job->pos, &job->scan, 1, job->quality, SLAM_HOLE_WIDTH_MAP, i, i + SLAM_MAPJOB_RAYS, job->stride);
+				xSemaphoreGive(mapMutex);
+			}
+
+			xSemaphoreTake(mapMutex, portMAX_DELAY);
+			slam_map_decay(&slam, MAP_DECAY_TILES_PER_UPDATE); //Let unconfirmed obstacles fade out
+			xSemaphoreGive(mapMutex);
+
+			xSemaphoreTake(mapMutex, portMAX_DELAY);
+			slam_distmap_update(&slam, MAP_DISTMAP_TILES_PER_UPDATE); //Update distance map in the changed regions
+			xSemaphoreGive(mapMutex);
+
+			if(job->nav) //Navigation space is not used for matching, no lock needed
+				slam_map_updateRays(&slam, &job->pos, &job->scan, 0, 100, SLAM_HOLE_WIDTH_NAV, 0, LASERSCAN_POINTS, 1);
+
+			slam_mapJobBusy[slot] = 0;
+		}
+	}
+}
+#endif
+
+
+//Movement of the robot between two poses, prepared to transform rays (see slam_rayMove)
+typedef struct {
+	float dist;
+	float c, s; //cos/sin of the change of the orientation
+	float c_half, s_half; //cos/sin of the half change (direction of the driven chord)
+} slam_move_t;
+
+static void slam_moveCalc(slam_move_t *move, odo_pose_t *from, odo_pose_t *to)
+{
+	float dpsi;
+
+	odo_delta(from, to, &move->dist, &dpsi);
+	move->c = cosf(dpsi * M_PI / 180);
+	move->s = sinf(dpsi * M_PI / 180);
+	move->c_half = cosf(dpsi * M_PI / 360);
+	move->s_half = sinf(dpsi * M_PI / 360);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// \brief slam_rayMove
+///			Transforms the ray i of the scan by the given movement of the
+///			robot: Rotation by the change of the orientation and
+///			translation by the driven distance (forward is -y). Afterwards
+///			the ray is seen from the pose the movement ends in.
+
+static void slam_rayMove(slam_t *slam, int16_t i, slam_move_t *move)
+{
+	float lx = slam->sensordata.scan.x[i];
+	float ly = slam->sensordata.scan.y[i];
+
+	slam->sensordata.scan.x[i] = (int16_t)floorf(move->c * lx + move->s * ly + move->dist * move->s_half + 0.5);
+	slam->sensordata.scan.y[i] = (int16_t)floorf(-move->s * lx + move->c * ly + move->dist * move->c_half + 0.5);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// \brief slam_waitForScan
+///			Waits until the lidar completed the next revolution. Its
+///			sectors are preprocessed while they arrive (see
+///			slam_processLaserscan).
+/// \param slam
+///			Slam container structure
+/// \param sector
+///			Last sector of the revolution (its frame is locked, release it
+///			with xv11_frameRelease)
+/// \return
+///			1 if the scan is complete
+
+static u8 slam_waitForScan(slam_t *slam, xv11_sector_t *sector)
+{
+	do
+	{
+		while(!xv11_sectorTake(sector, portMAX_DELAY));
+	} while(!slam_processLaserscan(slam, sector));
+
+	return 1;
+}
 
 //////////////////////////////////////////////////////////////////////////
 /// \brief slam_processLaserscan
-///			Compensates the movement of the roboter in the laser scan
-///			(If the robot moves with 0.3m/s and the lidar turns with 5Hz, the
-///			robot already moves 0.3m/s / 5Hz = 0.06m = 6cm in one scan!)
+///			Takes over the rays of the current lidar revolution and
+///			compensates the movement of the roboter during the scan (If the
+///			robot moves with 0.3m/s and the lidar turns with 5Hz, the robot
+///			already moves 0.3m/s / 5Hz = 0.06m = 6cm in one scan!).
+///
+///			Called for every completed sector of the revolution, so most of
+///			the work is done while the lidar is still turning: The new rays
+///			are passed through the scan filter (slam_filter.c), every filtered
+///			ray is converted and transformed from the position of the robot at the
+///			time it was measured (timestamp of its lidar package, or evenly
+///			spread over the revolution if the package has none, and odometry
+///			history) into the position at the start of the revolution. Rays
+///			that are newer than the latest odometry are left for the next
+///			call. When the revolution is complete, the remaining rays are
+///			processed and the whole scan is moved once into the position at
+///			the end of the scan.
 /// \param slam
 ///			Slam container structure
-/// \param speed_ms
-///			Robot speed in m/s
+/// \param sector
+///			Completed sector (see xv11_sectorTake)
+/// \return
+///			1 if the scan is complete (slam->sensordata.scan is valid)
 ///
-void slam_processLaserscan(slam_t *slam, XV11_t *xv11, float speed_ms)
+u8 slam_processLaserscan(slam_t *slam, xv11_sector_t *sector)
 {
-	float distCorrection_mm = 0;
+	xv11_frame_t *frame = sector->frame;
+	odo_pose_t pose_ray, pose_latest, pose_end;
+	slam_move_t move;
+	u_int32_t cycles_per_ms = DWT_CYCLES_PER_MS;
+	u_int32_t t_ray, t_ray_last = 0;
+	float period_ms = 200, off_ms;
+	int16_t i, i_sensor, last;
+
+	if(!slam_scanprep.active || (sector->seq != slam_scanprep.seq)) //New revolution
+	{
+		slam_scanprep.active = 1;
+		slam_scanprep.seq = sector->seq;
+		slam_scanprep.cursor = 0;
+		slam_scanprep.cursor_in = 0;
+		slam_filter_begin(slam, 90); //Sensor index 0 -> i = 90
+		slam_scanprep.ref_valid = (frame->t_start != 0) && odo_latest(&pose_latest);
+		if(slam_scanprep.ref_valid)
+			odo_poseAt(frame->t_start_tick, &slam_scanprep.pose_ref);
+	}
 
-	for(int16_t i = 0; i < LASERSCAN_POINTS; i++)
+	if(sector->complete)
+		last = LASERSCAN_POINTS;
+	else
+		last = XV11_SECTOR_FIRST_PKG(sector->sector + 1) * 4;
+
+	for(i_sensor = slam_scanprep.cursor_in; i_sensor < last; i_sensor++) //Filter the new rays
 	{
-		//distCorrection_mm += cosf((i + 180) * M_PI/180) * ((speed_ms / (xv11->speed / 60) / LASERSCAN_POINTS) * 1000);
+		i = i_sensor + 90; //Sensor index (i + 270) % 360 -> i
+		if(i >= LASERSCAN_POINTS)
+			i -= LASERSCAN_POINTS;
 
-		int16_t i_sensor = (i + 270);
-		if(i_sensor >= LASERSCAN_POINTS)
-			i_sensor -= LASERSCAN_POINTS;
+		slam->sensordata.strength[i] = frame->strength[i_sensor];
+		slam_filter_push(slam, (frame->dist_polar[i_sensor] > 0) ? frame->dist_polar[i_sensor] : LASERSCAN_NODATA);
+	}
+	slam_scanprep.cursor_in = last;
+	if(sector->complete)
+		slam_filter_flush(slam);
+	last = slam->filter.n_out; //Rays that are completely filtered (sensordata.lidar)
 
-		if(xv11->dist_polar[i_sensor] > 0)
-			slam->sensordata.lidar[i] = xv11->dist_polar[i_sensor] + (int)distCorrection_mm; //The dist correction value in the driving direction of the robot for one ray. (slam->sensordata.xv11->speed / 60): Speed in RPM, s now we get the turning frequency. Conversion only works for 360° Lidars!
-		else
-			slam->sensordata.lidar[i] = LASERSCAN_NODATA;
+	if(xv11.speed > XV11_SPEED_MIN)
+		period_ms = 60000 / xv11.speed; //Speed in RPM. Conversion only works for 360° Lidars!
+	if(!odo_latest(&pose_latest))
+		slam_scanprep.ref_valid = 0;
+
+	for(i_sensor = slam_scanprep.cursor; i_sensor < last; i_sensor++)
+	{
+		u_int32_t stamp = frame->pkt_stamp[i_sensor / 4];
+
+		i = i_sensor + 90; //Sensor index (i + 270) % 360 -> i
+		if(i >= LASERSCAN_POINTS)
+			i -= LASERSCAN_POINTS;
+
+		t_ray = 0;
+		if(slam_scanprep.ref_valid)
+		{
+			if(stamp != 0)
+				off_ms = (float)(stamp - frame->t_start) / cycles_per_ms - (3 - (i_sensor % 4)) * period_ms / LASERSCAN_POINTS; //The 4 rays of a package were measured before it was sent
+			else
+				off_ms = i_sensor * period_ms / LASERSCAN_POINTS; //Package without timestamp: Rays evenly spread over the revolution (index 0 is the oldest one)
+			t_ray = frame->t_start_tick + ((off_ms > 0) ? (u_int32_t)off_ms : 0);
+			if(!sector->complete && ((int32_t)(t_ray - pose_latest.t) > 0)) //No odometry yet: Next time
+				break;
+		}
+
+		slam_scan_fromPolar(slam, i, 1);
+
+		if((t_ray != 0) && ((slam->sensordata.scan.x[i] != 0) || (slam->sensordata.scan.y[i] != 0)))
+		{
+			if(t_ray != t_ray_last) //Rays measured in the same ms share the same movement
+			{
+				odo_poseAt(t_ray, &pose_ray);
+				slam_moveCalc(&move, &pose_ray, &slam_scanprep.pose_ref);
+				t_ray_last = t_ray;
+			}
+			slam_rayMove(slam, i, &move);
+		}
 	}
+	slam_scanprep.cursor = i_sensor;
+
+	if(!sector->complete)
+		return 0;
+
+	slam_scanprep.active = 0;
+
+	if(slam_scanprep.ref_valid) //Start of the revolution -> end
+	{
+		odo_poseAt(frame->t_end_tick, &pose_end);
+		slam_moveCalc(&move, &slam_scanprep.pose_ref, &pose_end);
+		for(i = 0; i < LASERSCAN_POINTS; i++)
+			if((slam->sensordata.scan.x[i] != 0) || (slam->sensordata.scan.y[i] != 0))
+				slam_rayMove(slam, i, &move);
+	}
+
+	return 1;
 }
 
 /////////////////////////////////////////////////////////////////
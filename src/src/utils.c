@@ -28,6 +28,17 @@ void HwInit( void ) {
 	// SysTick_CLKSourceConfig( SysTick_CLKSource_HCLK_Div8 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// Enables the DWT cycle counter (DWT_CYCCNT), used for timestamps with the
+/// resolution of one core clock cycle.
+////////////////////////////////////////////////////////////////////////////////
+
+void DWT_Init( void ) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; //Enable the trace unit (DWT)
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /// Sorts the elements of the given array by their size from the smallest to the
 /// biggest and returns a pointer to the element at @get (helpfull when used as
@@ -1,12 +1,15 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include <string.h>
 #include "stm32f4xx_conf.h"
 #include "xv11.h"
 #include "main.h"
 #include "utils.h"
 #include "outf.h"
 #include "stm32_ub_pwm_tim3.h"
+#include "rxring.h"
+#include "flashrec.h"
 #include "slam.h"
 #include "slamdefs.h"
 
@@ -19,7 +22,43 @@ volatile XV11_t xv11;
 
 volatile slam_coordinates_t scanStart_lastRobPos;
 
+static u_int8_t xv11_rxBuf[XV11_RXBUF_SIZE]; //Written by DMA2 Stream2 (circular)
+static rxring_t xv11_rx;
+static SemaphoreHandle_t xv11_rxSem = NULL; //Given by the DMA and idle line interrupts, wakes up the LIDAR task
+
+//Every interrupt of the receiver stores the absolute byte position and the DWT_CYCCNT
+//at that moment. The time of every byte is estimated from the next event after it.
+typedef struct {
+	u_int32_t pos; //rxring_produced() at the interrupt
+	u_int32_t stamp; //DWT_CYCCNT at the interrupt
+} xv11_rxevent_t;
+
+static volatile xv11_rxevent_t xv11_rxEvent[XV11_RXEVENTS];
+static volatile u_int8_t xv11_rxEventHead = 0;
+
+//Learned feed-forward PWM of the speed controller per battery bucket (0: not learned yet), stored with flashrec
+typedef struct {
+	u8 pwm[XV11_FF_BUCKETS];
+} xv11_ff_t;
+
+static xv11_ff_t xv11_ff;
+static u8 xv11_ffDirty = 0; //1: xv11_ff differs from the flash, save it when the robot stands still (see xv11_ffSave)
+
+//Speed controller and statistics of the current revolution (stable detection)
+typedef struct {
+	float ff; //Feed-forward PWM
+	float i; //Integral part
+	u_int32_t t_spinup; //systemTick when the motor was switched on
+	u8 learned; //1: Feed-forward was learned in this spin-up
+	u_int16_t n; //Packages in the current revolution
+	float sum, sumsq; //Sum of the speeds and of the squared speeds
+	float pwm_sum; //Sum of the PWM values
+} xv11_speedctrl_t;
+
+static QueueHandle_t xv11_sectorQueue = NULL; //Completed sectors (seq << 8 | complete << 7 | frame << 4 | sector), see xv11_sectorPost
+
 //Private Function Prototypes
+static u8 xv11_ffGet(void);
 
 /* This funcion initializes the USART1 peripheral
  *
@@ -32,7 +71,7 @@ int8_t xv11_state(u8 state)
 	if(state == XV11_STARTING)
 	{
 		xv11.state = XV11_STARTING;
-		UB_PWM_TIM3_SetPWM(PWM_T3_PB5, XV11_SPEED_PWM_INIT); //make sure motor is spinning
+		UB_PWM_TIM3_SetPWM(PWM_T3_PB5, xv11_ffGet()); //make sure motor is spinning
 	}
 	else if(state == XV11_OFF)
 		xv11.state = XV11_OFF;
@@ -40,11 +79,6 @@ int8_t xv11_state(u8 state)
 	return xv11.state;
 }
 
-enum SM_XV11 {
-	OFF, INIT_SEARCHSTART, SEARCHSTART,
-	GETPACKAGE, PROCESS
-};
-
 enum XV11_PACKAGE_DATA {
 	STARTBYTE = 0, INDEX,
 	SPEED_LSB, SPEED_MSB,
@@ -55,29 +89,473 @@ enum XV11_PACKAGE_DATA {
 	CHK_LSB, CHK_MSB
 };
 
-// this is the interrupt request handler (IRQ) for ALL USART1 interrupts
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_sectorTake
+///		Waits for the next completed sector of a revolution. If it is
+///		the last one (sector->complete), the frame is locked: The
+///		LIDAR task won't write into it until xv11_frameRelease is
+///		called (it drops revolutions in the meantime).
+/// \param sector
+///		Sector information is saved here
+/// \param wait
+///		Max. ticks to wait
+/// \return
+///		1 if there is a new sector. 0 on timeout or if the revolution
+///		was already overwritten.
+
+u8 xv11_sectorTake(xv11_sector_t *sector, portTickType wait)
+{
+	u_int32_t msg;
+	u8 idx, ret = 1;
+
+	if(xQueueReceive(xv11_sectorQueue, &msg, wait) != pdTRUE)
+		return 0;
+
+	idx = (msg >> 4) & 0x07;
+	sector->frame = (xv11_frame_t *) &xv11.frame[idx];
+	sector->sector = msg & 0x0F;
+	sector->complete = (msg >> 7) & 0x01;
+	sector->seq = msg >> 8;
+
+	if(sector->complete)
+	{
+		taskENTER_CRITICAL(); //The LIDAR task must not reuse the frame between checking and locking it
+		if((xv11.fill != idx) && ((xv11.frame[idx].seq & XV11_SEQ_MASK) == sector->seq))
+			xv11.locked = idx + 1;
+		else
+			ret = 0;
+		taskEXIT_CRITICAL();
+	}
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_sectorPost
+///		Hands the sector of the frame over to the SLAM task
+
+static void xv11_sectorPost(u8 idx, u8 sector, u8 complete)
+{
+	u_int32_t msg = ((xv11.frame[idx].seq & XV11_SEQ_MASK) << 8) | (complete << 7) | (idx << 4) | sector;
+
+	xQueueSendToBack(xv11_sectorQueue, &msg, 0); //If the SLAM task is that slow, it gets a gap in the sequence
+}
+
+void xv11_frameRelease(void)
+{
+	xv11.locked = 0;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_frameReset
+///		Clears the frame before it is filled again
+
+static void xv11_frameReset(volatile xv11_frame_t *frame, u_int32_t t_start, u_int32_t t_start_tick)
+{
+	for(u_int16_t i = 0; i < 360; i++)
+	{
+		frame->dist_polar[i] = XV11_VAR_NODATA;
+		frame->strength[i] = 0;
+	}
+	for(u8 i = 0; i < XV11_PACKAGES; i++)
+		frame->pkt_stamp[i] = 0;
+	frame->seq = xv11.rev_cnt;
+	frame->sectors = 0;
+	frame->coverage = 0;
+	frame->bad_pkts = 0;
+	frame->t_start = t_start;
+	frame->t_start_tick = t_start_tick;
+	frame->period = 0;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_frameSwap
+///		Completes the frame that is filled at the moment and hands
+///		its last sector over to the SLAM task. If the SLAM task still uses the
+///		other frame, the revolution is dropped and the same frame is
+///		filled again.
+/// \param t_end
+///		DWT_CYCCNT at the end of the revolution
+/// \return
+///		Measured duration of the revolution in cycles (0 if unknown)
+
+static u_int32_t xv11_frameSwap(u_int32_t t_end)
+{
+	volatile xv11_frame_t *frame = &xv11.frame[xv11.fill];
+	u8 idx = xv11.fill;
+
+	xv11.rev_cnt ++;
+	frame->t_end = t_end;
+	if(frame->t_start != 0)
+		frame->period = t_end - frame->t_start;
+	frame->t_end_tick = systemTick - (DWT_CYCCNT - t_end) / DWT_CYCLES_PER_MS;
+	u_int32_t period = frame->period;
+
+	taskENTER_CRITICAL();
+	if(xv11.locked != (2 - idx)) //Other frame is free
+	{
+		xv11.fill = 1 - idx;
+		xv11_sectorPost(idx, XV11_SECTORS - 1, 1);
+	}
+	else
+		xv11.frames_dropped ++;
+	taskEXIT_CRITICAL();
+
+	xv11_frameReset(&xv11.frame[xv11.fill], t_end, frame->t_end_tick);
+
+	return period;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_rxHead
+///		Write position of the DMA in xv11_rxBuf (HAL of the receive
+///		ring)
+
+static u_int16_t xv11_rxHead(void *ctx)
+{
+	u_int16_t head = XV11_RXBUF_SIZE - DMA_GetCurrDataCounter(DMA2_Stream2);
+	(void) ctx;
+
+	return (head >= XV11_RXBUF_SIZE) ? 0 : head;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_rxEventISR
+///		Saves the time of the interrupt and wakes up the LIDAR task
+
+static void xv11_rxEventISR(u_int32_t stamp, BaseType_t *woken)
+{
+	u_int8_t i = xv11_rxEventHead;
+
+	xv11_rxEvent[i].pos = rxring_produced(&xv11_rx);
+	xv11_rxEvent[i].stamp = stamp;
+	xv11_rxEventHead = (i + 1) & (XV11_RXEVENTS - 1);
+
+	xSemaphoreGiveFromISR(xv11_rxSem, woken);
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_rxStampAt
+///		Estimates the DWT_CYCCNT at the reception of the given byte:
+///		The first interrupt after the byte minus the time needed to
+///		receive the bytes between them (assumes that they were sent
+///		without a gap, so the result may be a bit too early).
+/// \param pos
+///		Absolute byte position (xv11_rx.consumed)
+
+static u_int32_t xv11_rxStampAt(u_int32_t pos)
+{
+	u_int32_t ev_pos, ev_stamp;
+	u_int8_t i, found = 0;
+
+	taskENTER_CRITICAL();
+	i = xv11_rxEventHead;
+	for(u8 n = 0; n < XV11_RXEVENTS; n++) //Newest to oldest
+	{
+		i = (i - 1) & (XV11_RXEVENTS - 1);
+		if((int32_t)(xv11_rxEvent[i].pos - pos) <= 0) //Event before the byte
+			break;
+		ev_pos = xv11_rxEvent[i].pos;
+		ev_stamp = xv11_rxEvent[i].stamp;
+		found = 1;
+	}
+	taskEXIT_CRITICAL();
+
+	if(!found) //Byte was received after the last interrupt
+	{
+		ev_stamp = DWT_CYCCNT;
+		ev_pos = rxring_produced(&xv11_rx);
+	}
+
+	return ev_stamp - (ev_pos - 1 - pos) * XV11_BYTE_CYCLES;
+}
+
+// DMA half transfer/transfer complete interrupt of the lidar receiver
+void DMA2_Stream2_IRQHandler(void)
+{
+	BaseType_t woken = pdFALSE;
+	u_int32_t stamp = DWT_CYCCNT; //As early as possible
+
+	if(DMA_GetITStatus(DMA2_Stream2, DMA_IT_TCIF2))
+	{
+		DMA_ClearITPendingBit(DMA2_Stream2, DMA_IT_TCIF2);
+		rxring_wrapped(&xv11_rx); //DMA starts at the beginning of the buffer again
+		xv11_rxEventISR(stamp, &woken);
+	}
+	if(DMA_GetITStatus(DMA2_Stream2, DMA_IT_HTIF2))
+	{
+		DMA_ClearITPendingBit(DMA2_Stream2, DMA_IT_HTIF2);
+		xv11_rxEventISR(stamp, &woken);
+	}
+	portEND_SWITCHING_ISR(woken);
+}
+
+// USART1 interrupt: Only the idle line (end of a package) is used, the data is received by the DMA
 void USART1_IRQHandler(void)
 {
-	static BaseType_t lidarISRnewDat = pdFALSE;
+	BaseType_t woken = pdFALSE;
+	u_int32_t stamp = DWT_CYCCNT; //As early as possible
 
-	// check if the USART1 receive interrupt flag was set
-	if( USART_GetITStatus(USART1, USART_IT_RXNE) )
+	if(USART_GetITStatus(USART1, USART_IT_IDLE))
 	{
-		u_int8_t data = USART1->DR; // the character from the USART1 data register is saved in data
-		if(xQueueLidar != 0)
-			xQueueSendToBackFromISR(xQueueLidar, &data, &lidarISRnewDat);
-		if(strlidar.active) //I lidar stream is active, stream lidar raw data
-			strlidar.put_c(data);
+		(void) USART1->SR; //Clear the idle flag (read SR, then DR)
+		(void) USART1->DR;
+		xv11_rxEventISR(stamp, &woken);
 	}
-	portEND_SWITCHING_ISR(lidarISRnewDat);
+	portEND_SWITCHING_ISR(woken);
 }
 
-// Task for processing the lidar data
-// ----------------------------------------------------------------------------
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_rxConsume
+///		Marks n bytes of the receive ring as read (and streams them
+///		if the raw lidar stream is active)
 
-QueueHandle_t xQueueLidar;
+static void xv11_rxConsume(u_int16_t n)
+{
+	if(strlidar.active) //If lidar stream is active, stream lidar raw data (in up to two blocks, the data may wrap around in the ring)
+	{
+		u_int8_t *ptr;
+		u_int16_t first = rxring_contiguous(&xv11_rx, &ptr);
+
+		if(first > n)
+			first = n;
+		out_puts_l(&strlidar, (const char *) ptr, first);
+		out_puts_l(&strlidar, (const char *) xv11_rx.buf, n - first);
+	}
+
+	rxring_consume(&xv11_rx, n);
+}
+
+//Unaligned 16 bit access into the receive buffer (the Cortex-M4 supports unaligned halfword loads)
+typedef struct __attribute__((packed)) {
+	u_int16_t v;
+} xv11_u16_t;
+
+#define XV11_WORD(pkg, i)	(((const xv11_u16_t *) &(pkg)[i])->v)
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_checksum
+///		Checksum of the XV-11 protocol over the first 20 bytes
+///		(10 little endian words) of the package
+/// \param pkg
+///		Package (XV11_PACKAGE_LENGTH bytes)
+/// \return
+///		1 if it matches the checksum in the package, otherwise 0
+
+static u_int8_t xv11_checksum(const u_int8_t *pkg)
+{
+	u_int32_t chk = 0;
 
-//static u_int8_t sm = INIT_SEARCHSTART;
+	for(u8 i = STARTBYTE; i < CHK_LSB; i += 2)
+		chk = (chk << 1) + XV11_WORD(pkg, i);
+
+	chk = (chk & 0x7FFF) + (chk >> 15);
+	chk &= 0x7FFF;
+
+	return (chk == XV11_WORD(pkg, CHK_LSB));
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_decode
+///		Decodes the four distances and signal strengths of the
+///		package without branches: Measurements with the invalid
+///		(bit 7) or the warning (bit 6) flag become XV11_VAR_NODATA
+///		(= 0) with strength 0.
+/// \param pkg
+///		Package
+/// \param dist
+///		4 distances (mm) are stored here
+/// \param strength
+///		4 signal strengths are stored here
+/// \return
+///		Amount of valid measurements
+
+static u8 xv11_decode(const u_int8_t *pkg, volatile int16_t *dist, volatile u_int16_t *strength)
+{
+	u8 cnt = 0;
+
+	for(u8 i = 0; i < 4; i++)
+	{
+		u_int16_t w = XV11_WORD(pkg, D0_B0 + (i * 4));
+		int16_t valid = ((w & 0xC000) == 0); //No flag set -> 1
+		dist[i] = (w & 0x3FFF) & -valid;
+		strength[i] = XV11_WORD(pkg, D0_B2 + (i * 4)) & -valid;
+		cnt += valid;
+	}
+
+	return cnt;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_ffBucket
+///		Bucket of the feed-forward table for the current battery
+///		state. The motor voltage (and so the PWM that is needed for
+///		XV11_SPEED_RPM_TO) sags with the battery.
+/// \return
+///		Bucket or XV11_FF_BUCKETS if the battery state is unknown
+
+static u8 xv11_ffBucket(void)
+{
+	if(battery.mV == 0) //Not read yet
+		return XV11_FF_BUCKETS;
+	if(battery.percent >= 100)
+		return XV11_FF_BUCKETS - 1;
+	if(battery.percent <= 0)
+		return 0;
+
+	return (battery.percent * XV11_FF_BUCKETS) / 100;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_ffGet
+///		Feed-forward PWM for the current battery state: Learned
+///		value of the bucket, otherwise the one of the nearest learned
+///		bucket, otherwise XV11_SPEED_PWM_INIT.
+
+static u8 xv11_ffGet(void)
+{
+	int8_t b = xv11_ffBucket();
+
+	if(b == XV11_FF_BUCKETS)
+		b = XV11_FF_BUCKETS / 2;
+
+	for(int8_t d = 0; d < XV11_FF_BUCKETS; d++)
+	{
+		if((b - d >= 0) && (xv11_ff.pwm[b - d] != 0))
+			return xv11_ff.pwm[b - d];
+		if((b + d < XV11_FF_BUCKETS) && (xv11_ff.pwm[b + d] != 0))
+			return xv11_ff.pwm[b + d];
+	}
+
+	return XV11_SPEED_PWM_INIT;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_ffLearn
+///		Saves the PWM that was needed for a stable speed in the
+///		table. If it differs noticeably from the stored one, the
+///		table is marked to be written into the flash later
+///		(xv11_ffSave).
+
+static void xv11_ffLearn(u8 pwm)
+{
+	u8 b = xv11_ffBucket();
+
+	if(b == XV11_FF_BUCKETS)
+		return;
+
+	if(abs(xv11_ff.pwm[b] - pwm) >= XV11_FF_SAVE_DIFF)
+	{
+		xv11_ff.pwm[b] = pwm;
+		xv11_ffDirty = 1;
+	}
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_ffSave
+///		Writes a changed feed-forward table into the flash, but only
+///		while the robot stands still: flashrec_write may have to erase
+///		the flash sector, which stalls the whole controller for 1-2s
+///		(no communication with the motor controller, no SLAM).
+
+static void xv11_ffSave(void)
+{
+	if(!xv11_ffDirty)
+		return;
+
+	if(!motor.driver_standby &&
+	   ((motor.speed_l_to != 0) || (motor.speed_r_to != 0) || (motor.speed_l_is != 0) || (motor.speed_r_is != 0)))
+		return;
+
+	xv11_ffDirty = 0;
+	if(!flashrec_write(&xv11_ff, sizeof(xv11_ff)))
+		foutf(&error, "xv11: could not save the feed-forward table\n");
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_speedStart
+///		Switches the motor on with the feed-forward PWM
+
+static void xv11_speedStart(xv11_speedctrl_t *ctrl)
+{
+	ctrl->ff = xv11_ffGet();
+	ctrl->i = 0;
+	ctrl->t_spinup = systemTick;
+	ctrl->learned = 0;
+	ctrl->n = 0;
+	ctrl->sum = ctrl->sumsq = ctrl->pwm_sum = 0;
+
+	UB_PWM_TIM3_SetPWM(PWM_T3_PB5, (int) ctrl->ff);
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_speedControl
+///		PI controller with feed-forward, called for every package
+///		(with the speed measured by the lidar)
+
+static void xv11_speedControl(xv11_speedctrl_t *ctrl)
+{
+	float e = XV11_SPEED_RPM_TO - xv11.speed;
+	float pwm = ctrl->ff + XV11_SPEED_KP * e + ctrl->i;
+
+	if(pwm > 255.0) //8bit PWM
+		pwm = 255.0;
+	else if(pwm < XV11_SPEED_MIN)
+		pwm = XV11_SPEED_MIN;
+	else
+		ctrl->i += e * XV11_SPEED_KI; //Integrate only if not saturated (anti windup)
+
+	UB_PWM_TIM3_SetPWM(PWM_T3_PB5, (int) pwm);
+
+	ctrl->n ++;
+	ctrl->sum += xv11.speed;
+	ctrl->sumsq += xv11.speed * xv11.speed;
+	ctrl->pwm_sum += pwm;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief xv11_speedRevolution
+///		Called at the end of every revolution: The lidar is stable
+///		(XV11_ON) if it sent (nearly) all packages of the revolution
+///		and their mean speed and standard deviation are within the
+///		limits. The first time it is stable, the time since switching
+///		it on is reported and the feed-forward PWM is learned.
+
+static void xv11_speedRevolution(xv11_speedctrl_t *ctrl)
+{
+	u8 stable = 0;
+
+	if(ctrl->n >= XV11_STABLE_PKTS)
+	{
+		float mean = ctrl->sum / ctrl->n;
+		float var = ctrl->sumsq / ctrl->n - mean * mean;
+
+		stable = (fabsf(mean - XV11_SPEED_RPM_TO) < XV11_SPEED_LIM) && (var < XV11_STABLE_STD * XV11_STABLE_STD);
+	}
+
+	if(stable)
+	{
+		if(xv11.state == XV11_STARTING)
+		{
+			xv11.state = XV11_ON;
+			if(!ctrl->learned)
+			{
+				ctrl->learned = 1;
+				xv11.ready_ms = systemTick - ctrl->t_spinup;
+				foutf(&debugOS, "xv11: ready after %ims\n", xv11.ready_ms);
+				xv11_ffLearn((u8) (ctrl->pwm_sum / ctrl->n + 0.5));
+			}
+		}
+	}
+	else if(xv11.state == XV11_ON)
+		xv11.state = XV11_STARTING;
+
+	ctrl->n = 0;
+	ctrl->sum = ctrl->sumsq = ctrl->pwm_sum = 0;
+}
+
+// Task for processing the lidar data
+// ----------------------------------------------------------------------------
 
 portTASK_FUNCTION( vLIDARTask, pvParameters )
 {
@@ -85,134 +563,101 @@ portTASK_FUNCTION( vLIDARTask, pvParameters )
 
 	foutf(&debugOS, "xTask LIDAR started.\n");
 
-	xQueueLidar = xQueueCreate( 100, sizeof(u_int8_t));
-    if( xQueueLidar == 0 )
-    	foutf(&error, "xQueueLidar COULD NOT BE CREATED!\n");
-
-	u_int8_t sm = INIT_SEARCHSTART;
-	u_int8_t data;
+	u_int8_t motor_on = 0;
 	u_int16_t xv11_dist_index = 0;
-	float xv11_speedreg_i = XV11_SPEED_IREG_INIT; //I-Regulator (speed)
-	u_int8_t xv11_state_on_cnt = 0; //Before the state switches to "XV11_ON", the rpm has to be stable a few iterations
-	u_int32_t checksum = 0;
+	u_int8_t pkg_index;
+	int16_t pkg_index_last = -1; //Index of the last package, -1: none since the motor was switched on
+	xv11_speedctrl_t speedctrl;
+	u_int32_t pkt_stamp = 0; //Timestamp of the start byte of the current package
+	u_int32_t rev_period = 0; //Duration of the last revolution in cycles
+	volatile xv11_frame_t *frame;
 
-	u_int8_t xv11_package[XV11_PACKAGE_LENGTH];
+	u_int8_t xv11_package[XV11_PACKAGE_LENGTH]; //Only used if a package wraps around the end of the receive buffer
+	const u_int8_t *pkg;
 
 	for(;;)
 	{
-		xQueueReceive(xQueueLidar, &data, portMAX_DELAY); //Blocks until new data arrive
+		u_int16_t avail = rxring_available(&xv11_rx);
 
 		if(xv11.state == XV11_OFF)
-			sm = OFF;
-
-		switch(sm)
 		{
-		case OFF:
 			UB_PWM_TIM3_SetPWM(PWM_T3_PB5, 0); //power down motor
-			if(xv11.state == XV11_STARTING)
-				sm = INIT_SEARCHSTART;
-			break;
-		case INIT_SEARCHSTART: //Find start byte of protocol
+			motor_on = 0;
+			pkg_index_last = -1;
+			xv11_rxConsume(avail); //Nothing to do with the data
+			avail = 0;
+		}
+		else if(!motor_on)
+		{
+			xv11_speedStart(&speedctrl); //make sure motor is spinning
+			motor_on = 1;
+		}
 
-			UB_PWM_TIM3_SetPWM(PWM_T3_PB5, XV11_SPEED_PWM_INIT); //make sure motor is spinning
+		if(avail < XV11_PACKAGE_LENGTH) //Sleep until the DMA received new data
+		{
+			xv11_ffSave();
+			xSemaphoreTake(xv11_rxSem, XV11_RX_TIMEOUT_MS / portTICK_RATE_MS);
+			continue;
+		}
 
-			sm = SEARCHSTART;
+		//Find the package start: Start byte and valid index
+		if((rxring_peek(&xv11_rx, STARTBYTE) != 0xFA) ||
+		   (rxring_peek(&xv11_rx, INDEX) < 0xA0) || (rxring_peek(&xv11_rx, INDEX) >= (0xA0 + XV11_PACKAGES)))
+		{
+			xv11_rxConsume(1);
+			continue;
+		}
 
-		case SEARCHSTART:
+		//Parse the package directly in the receive buffer (copy it only if it wraps around)
+		u_int8_t *ptr;
+		if(rxring_contiguous(&xv11_rx, &ptr) >= XV11_PACKAGE_LENGTH)
+			pkg = ptr;
+		else
+		{
+			for(u8 i = 0; i < XV11_PACKAGE_LENGTH; i++)
+				xv11_package[i] = rxring_peek(&xv11_rx, i);
+			pkg = xv11_package;
+		}
 
-			if(data == 0xFA)
-				sm = GETPACKAGE;
-			else
-				break;
+		if(!xv11_checksum(pkg)) //Corrupted (or 0xFA inside of a package): Search the next start byte
+		{
+			xv11.bad_pkts ++;
+			xv11.frame[xv11.fill].bad_pkts ++;
+			xv11_rxConsume(1);
+			continue;
+		}
 
-		case GETPACKAGE ... (GETPACKAGE + (XV11_PACKAGE_LENGTH - 1)):
+		pkt_stamp = xv11_rxStampAt(xv11_rx.consumed);
 
-			xv11_package[sm - GETPACKAGE] = data;
-			sm ++;
-			if(sm != (PROCESS + (XV11_PACKAGE_LENGTH - 1)))
-				break;
+		pkg_index = pkg[INDEX] - 0xA0;
+		if(pkg_index == pkg_index_last) //Same package again: Neither a new revolution nor a new speed sample
+		{
+			xv11_rxConsume(XV11_PACKAGE_LENGTH);
+			continue;
+		}
+		xv11_dist_index = pkg_index * 4;
+		xv11.speed = XV11_WORD(pkg, SPEED_LSB) / 64.0;
 
-		case (PROCESS + (XV11_PACKAGE_LENGTH - 1)): //Process
+		if(pkg_index_last < 0) //First package since the motor was switched on: No revolution ended, start with an empty frame
+			xv11_frameReset(&xv11.frame[xv11.fill], 0, 0);
+		else if(pkg_index < pkg_index_last) //New revolution (also if the package with index 0 was lost): Hand the frame over to the SLAM task
+		{
+			rev_period = xv11_frameSwap(pkt_stamp - pkg_index * (rev_period / XV11_PACKAGES)); //Expected time of package 0
+			xv11_speedRevolution(&speedctrl);
+		}
+		pkg_index_last = pkg_index;
 
-			if(xv11_package[STARTBYTE] != 0xFA) //lost package start
-			{
-				sm = INIT_SEARCHSTART;
-			}
-			else //compute checksum and compare
-			{
-				for(u8 i = STARTBYTE; i < CHK_LSB; i += 2)
-				{
-					checksum = (checksum << 1) + (xv11_package[i] + (xv11_package[i + 1] << 8));
-				}
-				checksum = (checksum & 0x7FFF) + (checksum >> 15);
-				checksum &= 0x7FFF;
-
-				/*for(u8 i = 0; i < XV11_PACKAGE_LENGTH; i++)
-				{
-					foutf(&debugOS, "%i ", xv11_package[i]);
-				}
-				foutf(&debugOS, "\n");*/
-
-				//if(checksum == (xv11_package[CHK_LSB] + (xv11_package[CHK_MSB] << 8))) //checksum matches
-				//{
-					xv11_dist_index = (xv11_package[INDEX] - 0xA0) * 4;
-					xv11.speed = (xv11_package[SPEED_LSB] | (xv11_package[SPEED_MSB] << 8)) / 64.0;
-
-					if(xv11_dist_index == 0) //Synchronization var with the slam algorithm
-					{
-						xSemaphoreGive(lidarSync);
-					}
-
-					for(u8 i = 0; i < 4; i++)
-					{
-						xv11.dist_polar[xv11_dist_index + i] = xv11_package[D0_B0 + (i * 4)] + ((xv11_package[D0_B1 + (i * 4)] & 0x3F) << 8);
-						if((xv11_package[D0_B1 + (i * 4)] & 0x80) || (xv11_package[D0_B1 + (i * 4)] & 0x40)) //invalid data flag
-							xv11.dist_polar[xv11_dist_index + i] = XV11_VAR_NODATA;
-					}
-
-					xv11_speedreg_i += ((XV11_SPEED_RPM_TO - xv11.speed) / XV11_SPEED_DIV_I);
-					if(xv11_speedreg_i > 255.0) //8bit PWM
-						xv11_speedreg_i = 255.0;
-					else if(xv11_speedreg_i < XV11_SPEED_MIN)
-						xv11_speedreg_i = XV11_SPEED_MIN;
-
-					UB_PWM_TIM3_SetPWM(PWM_T3_PB5, (int) xv11_speedreg_i);
-
-					if((xv11.speed < (XV11_SPEED_RPM_TO - XV11_SPEED_LIM)) ||
-						(xv11.speed > (XV11_SPEED_RPM_TO + XV11_SPEED_LIM)))
-					{
-						xv11_state_on_cnt = 0;
-						xv11.state = XV11_STARTING;
-					}
-					else
-					{
-						xv11_state_on_cnt ++;
-
-						if(xv11_state_on_cnt > XV11_STATE_ON_CNT)
-							xv11.state = XV11_ON;
-					}
-			/*	}
-				else //checksum does not match
-				{
-					for(u_int8_t i = 4; i < 8; i++)
-					{
-						xv11.dist_polar[xv11_dist_index + i] = XV11_VAR_NODATA; //clear the distance information of the package with the false checksum
-					}
-
-					xv11_dist_index += 4; //In case the next package is also false and this var can’t set new, go to the next package index
-					if(xv11_dist_index > 359)
-						xv11_dist_index = 0;
-					sm = INIT_SEARCHSTART;
-				}*/
-
-				sm = GETPACKAGE;
-			}
-			break;
+		frame = &xv11.frame[xv11.fill];
+		frame->pkt_stamp[pkg_index] = pkt_stamp;
+		frame->coverage += xv11_decode(pkg, &frame->dist_polar[xv11_dist_index], &frame->strength[xv11_dist_index]);
 
-		default:
-			break;
-		}
-    }
+		while(frame->sectors < XV11_SECTOR(pkg_index)) //The sectors before the one of this package are complete
+			xv11_sectorPost(xv11.fill, frame->sectors ++, 0);
+
+		xv11_rxConsume(XV11_PACKAGE_LENGTH);
+
+		xv11_speedControl(&speedctrl);
+	}
 }
 
 void xv11_init(void)
@@ -228,6 +673,15 @@ void xv11_init(void)
 	GPIO_InitTypeDef GPIO_InitStructure; // this is for the GPIO pins used as TX and RX
 	USART_InitTypeDef USART_InitStruct; // this is for the USART1 initilization
 	NVIC_InitTypeDef NVIC_InitStructure; // this is used to configure the NVIC (nested vector interrupt controller)
+	DMA_InitTypeDef DMA_InitStructure; // the received data is written into xv11_rxBuf by the DMA
+
+	xv11_rxSem = xSemaphoreCreateBinary();
+	xv11_sectorQueue = xQueueCreate(2 * XV11_SECTORS, sizeof(u_int32_t));
+	xv11_frameReset(&xv11.frame[0], 0, 0);
+	if(!flashrec_read(&xv11_ff, sizeof(xv11_ff))) //Nothing learned yet
+		memset(&xv11_ff, 0, sizeof(xv11_ff));
+	xv11.fill = 0;
+	rxring_init(&xv11_rx, xv11_rxBuf, XV11_RXBUF_SIZE, &xv11_rxHead, NULL);
 
 	/* enable APB2 peripheral clock for USART1
 	 * note that only USART1 and USART6 are connected to APB2
@@ -269,12 +723,36 @@ void xv11_init(void)
 	USART_Init(USART1, &USART_InitStruct);					// again all the properties are passed to the USART_Init function which takes care of all the bit setting
 
 
-	/* Here the USART1 receive interrupt is enabled
-	 * and the interrupt controller is configured
-	 * to jump to the USART1_IRQHandler() function
-	 * if the USART1 receive interrupt occurs
+	/* USART1 RX is DMA2 Stream2 Channel4. The DMA writes into
+	 * xv11_rxBuf in circular mode, so no byte has to be handled
+	 * by the CPU. Half transfer, transfer complete and the idle
+	 * line (gap after a package) interrupts wake up the task.
 	 */
-	USART_ITConfig(USART1, USART_IT_RXNE, ENABLE); // enable the USART1 receive interrupt
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+
+	DMA_DeInit(DMA2_Stream2);
+	DMA_InitStructure.DMA_Channel = DMA_Channel_4;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (u_int32_t) &USART1->DR;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (u_int32_t) xv11_rxBuf;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMA_InitStructure.DMA_BufferSize = XV11_RXBUF_SIZE;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+	DMA_Init(DMA2_Stream2, &DMA_InitStructure);
+
+	DMA_ITConfig(DMA2_Stream2, DMA_IT_HT | DMA_IT_TC, ENABLE);
+	USART_DMACmd(USART1, USART_DMAReq_Rx, ENABLE);
+	DMA_Cmd(DMA2_Stream2, ENABLE);
+
+	USART_ITConfig(USART1, USART_IT_IDLE, ENABLE); // enable the USART1 idle line interrupt
 
 	// Configure the NVIC Preemption Priority Bits
 	// wichtig!, sonst stimmt nichts überein mit den neuen ST Libs (ab Version 3.1.0)
@@ -287,6 +765,9 @@ void xv11_init(void)
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
 	NVIC_Init( &NVIC_InitStructure );
 
+	NVIC_InitStructure.NVIC_IRQChannel = DMA2_Stream2_IRQn; //Same priority as the USART
+	NVIC_Init( &NVIC_InitStructure );
+
 	// finally this enables the complete USART1 peripheral
 	USART_Cmd(USART1, ENABLE);
 
@@ -0,0 +1,286 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// binlog_decode.c - Decoder of the PC link output (runs on the PC)
+///
+/// Reads the output of the PC link (USART2, e.g. the bluetooth serial port or a
+/// file it was logged into) and separates the channels again (frames: see
+/// Libraries/lib/inc/txmux.h, channels: PCLINK_CH in src/inc/debug.h). The text
+/// channels are written as text, their binary log frames (binlog.h) are formatted
+/// with the same format table the robot was built with. A raw channel (e.g. the
+/// messages for the SlamUI) can be written unchanged instead.
+///
+/// Build: gcc -std=gnu99 -I../Libraries/lib/inc -o binlog_decode binlog_decode.c
+/// Usage: binlog_decode [-t] [-c channel]... [-r channel] [file]
+///        -t: Prefix the binary log messages with the systemTick
+///        -c: Decode this channel (default: 0 and 1, system and debug)
+///        -r: Only write the data of this channel, unchanged
+///        Without a file stdin is read.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "binlog.h"
+#include "txmux.h"
+
+#define CHANNELS	256
+
+static const char *binlog_formats[BINLOG_IDS] = {
+#define BINLOG_MSG(id, format)	format,
+	BINLOG_MESSAGES
+#undef BINLOG_MSG
+};
+
+//Parser of a text channel (a binary log frame can be split over several frames of the link)
+typedef struct {
+	int decode; //Channel selected
+	int state; //0: Text, 1: BINLOG_START0 received, 2: In a binary log frame
+	uint8_t frame[BINLOG_FRAME_MAX];
+	int len; //Received bytes of frame
+} chan_t;
+
+static chan_t chan[CHANNELS];
+static int show_time = 0;
+
+//Received bytes that are not processed yet (win[0]: TXMUX_SYNC of the next frame)
+static uint8_t win[TXMUX_FRAME_MAX];
+static int win_n = 0;
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief render
+///		Prints the format with the arguments (integer conversions
+///		with fill and width, like foutf)
+
+static void render(const char *fmt, int n, const int32_t *args)
+{
+	int a = 0;
+
+	for(; *fmt; fmt++)
+	{
+		char spec[16] = "%";
+		int len = 1;
+
+		if(*fmt != '%')
+		{
+			putchar(*fmt);
+			continue;
+		}
+
+		fmt++;
+		if(*fmt == '%')
+		{
+			putchar('%');
+			continue;
+		}
+
+		while(((*fmt == '0') || ((*fmt >= '1') && (*fmt <= '9'))) && (len < 10))
+			spec[len++] = *fmt++;
+
+		if(a >= n)
+		{
+			printf("<?>");
+			continue;
+		}
+
+		switch(*fmt)
+		{
+		case 'd':
+		case 'i': spec[len] = 'd'; printf(spec, (int) args[a]); break;
+		case 'u':
+		case 'x':
+		case 'X': spec[len] = *fmt; printf(spec, (unsigned int) args[a]); break;
+		case 'c': putchar((char) args[a]); break;
+		default: printf("<%%%c?>", *fmt); break;
+		}
+		a++;
+
+		if(*fmt == 0)
+			break;
+	}
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief decode_binlog
+///		Prints a complete binary log frame
+
+static void decode_binlog(const uint8_t *frame, int len)
+{
+	int32_t args[BINLOG_ARGS_MAX];
+	uint8_t chk = 0;
+
+	for(int i = 2; i < len - 1; i++)
+		chk += frame[i];
+	if(chk != frame[len - 1])
+	{
+		printf("<binlog: checksum error>\n");
+		return;
+	}
+
+	for(int i = 0; i < frame[3]; i++)
+		args[i] = (int32_t) get32(&frame[BINLOG_HEADER + 4 * i]);
+
+	if(show_time)
+		printf("[%u] ", get32(&frame[4]));
+
+	if(frame[2] < BINLOG_IDS)
+		render(binlog_formats[frame[2]], frame[3], args);
+	else
+		printf("<binlog: unknown id %i (newer firmware?)>\n", frame[2]);
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief chan_byte
+///		Next byte of a text channel
+
+static void chan_byte(chan_t *c, uint8_t b)
+{
+	switch(c->state)
+	{
+	case 0:
+		if(b == BINLOG_START0)
+			c->state = 1;
+		else
+			putchar(b);
+		break;
+
+	case 1:
+		if(b == BINLOG_START1)
+		{
+			c->frame[0] = BINLOG_START0;
+			c->frame[1] = BINLOG_START1;
+			c->len = 2;
+			c->state = 2;
+		}
+		else
+		{
+			putchar(BINLOG_START0);
+			c->state = 0;
+			chan_byte(c, b);
+		}
+		break;
+
+	case 2:
+		c->frame[c->len++] = b;
+		if((c->len == 4) && (c->frame[3] > BINLOG_ARGS_MAX))
+		{
+			printf("<binlog: broken frame>\n");
+			c->state = 0;
+		}
+		else if((c->len > 4) && (c->len == BINLOG_HEADER + 4 * c->frame[3] + 1))
+		{
+			decode_binlog(c->frame, c->len);
+			c->state = 0;
+		}
+		break;
+	}
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief win_fill
+///		Reads until n bytes are in the window
+/// \return
+///		0 at the end of the input
+
+static int win_fill(FILE *in, int n)
+{
+	while(win_n < n)
+	{
+		int c = getc(in);
+
+		if(c == EOF)
+			return 0;
+		win[win_n++] = c;
+	}
+
+	return 1;
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief win_drop
+///		Removes n bytes from the beginning of the window
+
+static void win_drop(int n)
+{
+	memmove(win, &win[n], win_n - n);
+	win_n -= n;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	int raw = -1; //Raw channel
+	int selected = 0;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-t") == 0)
+			show_time = 1;
+		else if((strcmp(argv[i], "-c") == 0) && (i + 1 < argc))
+		{
+			chan[atoi(argv[++i]) % CHANNELS].decode = 1;
+			selected = 1;
+		}
+		else if((strcmp(argv[i], "-r") == 0) && (i + 1 < argc))
+			raw = atoi(argv[++i]);
+		else if((in = fopen(argv[i], "rb")) == NULL)
+		{
+			perror(argv[i]);
+			return 1;
+		}
+	}
+	if(!selected)
+		chan[0].decode = chan[1].decode = 1;
+
+	while(win_fill(in, 1))
+	{
+		uint8_t chk;
+		int len;
+
+		if(win[0] != TXMUX_SYNC) //Between the frames (e.g. after a transmission error)
+		{
+			win_drop(1);
+			continue;
+		}
+
+		if(!win_fill(in, 3))
+			break;
+		len = win[2];
+		if(len > TXMUX_PAYLOAD_MAX) //Not a frame: TXMUX_SYNC in the data of a lost frame
+		{
+			win_drop(1);
+			continue;
+		}
+		if(!win_fill(in, len + 4))
+			break;
+
+		chk = win[1] + win[2];
+		for(int i = 0; i < len; i++)
+			chk += win[3 + i];
+		if(chk != win[3 + len])
+		{
+			fprintf(stderr, "<link: checksum error>\n");
+			win_drop(1); //The real start of the next frame can be in the rejected bytes
+			continue;
+		}
+
+		if(raw >= 0)
+		{
+			if(win[1] == raw)
+				fwrite(&win[3], 1, len, stdout);
+		}
+		else if(chan[win[1]].decode)
+		{
+			for(int i = 0; i < len; i++)
+				chan_byte(&chan[win[1]], win[3 + i]);
+		}
+		win_drop(len + 4);
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// check.h - Checks of the tests in tools/ (one test program per module)
+///
+/// CHECK prints the failed condition with its position and a message (printf
+/// format) and counts it in failed, the test goes on. main returns failed != 0.
+//////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int failed = 0; //Amount of failed checks
+
+#define CHECK(cond, ...)	do { if(!(cond)) { printf("FAIL %s:%i: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failed ++; } } while(0)
+
+#endif // CHECK_H
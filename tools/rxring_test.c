@@ -0,0 +1,175 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// rxring_test.c - Test of the receive ring with a simulated byte source (runs on the PC)
+///
+/// The simulated producer behaves like the DMA in circular mode: It writes into
+/// the buffer and restarts at the beginning by itself, the "transfer complete
+/// interrupt" (rxring_wrapped) may come later. Every byte is the low byte of its
+/// absolute position, so the consumer can check that it gets every byte once and
+/// in order, and that it never gets data of an older run through the buffer.
+///
+/// Build and run: make -C tools test
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rxring.h"
+#include "check.h"
+
+#define SIZE	64
+
+typedef struct {
+	u_int8_t buf[SIZE];
+	u_int16_t pos; //Write position (NDTR)
+	u_int32_t written; //Absolute amount of written bytes
+	u_int8_t pending; //Wrap the interrupt has not reported yet
+	rxring_t *ring;
+} sim_t;
+
+static u_int16_t sim_head(void *ctx)
+{
+	return ((sim_t *) ctx)->pos;
+}
+
+static void sim_interrupt(sim_t *sim)
+{
+	if(sim->pending)
+		rxring_wrapped(sim->ring);
+	sim->pending = 0;
+}
+
+static void sim_write(sim_t *sim, u_int16_t n)
+{
+	for(u_int16_t i = 0; i < n; i++)
+	{
+		sim->buf[sim->pos] = sim->written & 0xff;
+		sim->written ++;
+		if(++sim->pos == SIZE)
+		{
+			sim_interrupt(sim); //The interrupt may be late, but not by a whole run through the buffer
+			sim->pos = 0;
+			sim->pending = 1;
+		}
+	}
+}
+
+static void sim_init(sim_t *sim, rxring_t *ring)
+{
+	sim->pos = 0;
+	sim->written = 0;
+	sim->pending = 0;
+	sim->ring = ring;
+	rxring_init(ring, sim->buf, SIZE, sim_head, sim);
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief consume
+///		Reads up to max bytes (contiguous part and peek), checks them
+/// \return
+///		Amount of bytes read
+
+static u_int16_t consume(rxring_t *ring, u_int16_t max)
+{
+	u_int8_t *ptr;
+	u_int16_t n = rxring_contiguous(ring, &ptr);
+	u_int16_t avail = rxring_available(ring);
+
+	CHECK(n <= avail, "contiguous %i > available %i", n, avail);
+	if(avail > max)
+		avail = max;
+
+	for(u_int16_t i = 0; i < avail; i++)
+	{
+		u_int8_t expected = (ring->consumed + i) & 0xff;
+		u_int8_t c = (i < n) ? ptr[i] : rxring_peek(ring, i);
+
+		CHECK(c == expected, "byte %u: %i instead of %i", ring->consumed + i, c, expected);
+	}
+	rxring_consume(ring, avail);
+
+	return avail;
+}
+
+//Producer and consumer in random steps, the interrupt is always in time
+static void test_stream(void)
+{
+	sim_t sim;
+	rxring_t ring;
+
+	sim_init(&sim, &ring);
+	for(int i = 0; i < 100000; i++)
+	{
+		sim_write(&sim, rand() % (SIZE / 2));
+		sim_interrupt(&sim);
+		consume(&ring, SIZE / 2 + rand() % (SIZE / 2)); //At least as much as written, partial reads
+	}
+	consume(&ring, SIZE);
+
+	CHECK(ring.consumed == sim.written, "consumed %u of %u", ring.consumed, sim.written);
+	CHECK(ring.overruns == 0, "%u overruns", ring.overruns);
+}
+
+//The consumer reads after the DMA restarted at the beginning, but before the interrupt
+static void test_pendingWrap(void)
+{
+	sim_t sim;
+	rxring_t ring;
+
+	sim_init(&sim, &ring);
+
+	sim_write(&sim, SIZE - 4);
+	CHECK(consume(&ring, SIZE) == SIZE - 4, "first part");
+
+	sim_write(&sim, 10); //Wraps, head() is 6 now, wraps still 0
+	CHECK(rxring_available(&ring) == 10, "available %i instead of 10", rxring_available(&ring));
+	CHECK(consume(&ring, SIZE) == 10, "across the pending wrap");
+	CHECK(ring.overruns == 0, "pending wrap counted as overrun");
+
+	sim_interrupt(&sim);
+	CHECK(rxring_available(&ring) == 0, "old data delivered again after the interrupt (%i bytes)", rxring_available(&ring));
+
+	for(int i = 0; i < 100000; i++) //Random: The interrupt comes late
+	{
+		sim_write(&sim, rand() % (SIZE / 2));
+		consume(&ring, SIZE / 2 + rand() % (SIZE / 2));
+		if(rand() % 2)
+			sim_interrupt(&sim);
+	}
+	sim_interrupt(&sim);
+	consume(&ring, SIZE);
+
+	CHECK(ring.consumed == sim.written, "consumed %u of %u", ring.consumed, sim.written);
+	CHECK(ring.overruns == 0, "%u overruns", ring.overruns);
+}
+
+//The producer overtakes the consumer: Overrun, the consumer continues with new data
+static void test_overrun(void)
+{
+	sim_t sim;
+	rxring_t ring;
+
+	sim_init(&sim, &ring);
+
+	sim_write(&sim, 3 * SIZE + 5);
+	sim_interrupt(&sim);
+	CHECK(rxring_available(&ring) == 0, "overrun not detected");
+	CHECK(ring.overruns == 1, "%u overruns instead of 1", ring.overruns);
+	CHECK(ring.consumed == sim.written, "not continued at the producer");
+
+	sim_write(&sim, 20);
+	sim_interrupt(&sim);
+	CHECK(consume(&ring, SIZE) == 20, "new data after the overrun");
+}
+
+int main(void)
+{
+	srand(1);
+
+	test_stream();
+	test_pendingWrap();
+	test_overrun();
+
+	printf("rxring_test: %s\n", failed ? "FAILED" : "ok");
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,542 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// subctrl_sim.c - Test of the subcontroller link against a simulated slave (runs on the PC)
+///
+/// The simulated subcontroller runs in a thread on the master side of a pty and
+/// answers the packages (0xAB and, unless it simulates an old slave, 0xAC; see the
+/// protocol in Libraries/lib/src/comm_api.c) from its own register array. It parses
+/// and encodes the packages itself, so it checks comm_txn_frame and comm_link_rxByte
+/// instead of agreeing with them. The link side uses the other end of the pty like
+/// the USART and runs comm_link_transfer and comm_link_probe, the functions behind
+/// comm_transferBatch and comm_probePipelined. Faults can be injected into the
+/// answers of the next requests.
+///
+/// Build and run: make -C tools test
+//////////////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "comm_txn.h"
+#include "check.h"
+
+#define SIM_FAULTS	16
+
+//Fault in the answer to a request
+enum SIM_FAULT {
+	SIM_OK, //Correct answer
+	SIM_DROP, //No answer
+	SIM_CHECKSUM, //Wrong checksum
+	SIM_SEQ, //Wrong sequence number (the one of another request)
+	SIM_TRUNCATE, //The last bytes are missing
+	SIM_HOLD, //Sent after the answer to the next request (out of order)
+	SIM_LATE, //Sent when the next request arrives (a single request times out before)
+	SIM_SHORT //Answer to a read request with one data byte less (valid checksum)
+};
+
+//Simulated subcontroller
+typedef struct {
+	int fd; //Master side of the pty
+	uint8_t legacy; //1: Does not understand the pipelined protocol (ignores the 0xAC packages)
+	uint8_t reg[COMM_REGISTERS_CNT]; //Register map
+	uint8_t fault[SIM_FAULTS]; //Faults of the next answers (SIM_...)
+	uint8_t faults; //Amount of faults in fault
+	uint8_t held[COMM_FRAME_MAX]; //Answer that is sent later (SIM_HOLD, SIM_LATE)
+	uint8_t held_len;
+	uint8_t held_fault;
+	uint32_t requests; //Packages received
+	uint32_t bad; //Packages with wrong checksum received
+	volatile uint8_t stop;
+	pthread_mutex_t lock; //Everything above
+} sim_t;
+
+//Link side of the pty
+typedef struct {
+	int fd; //Slave side of the pty (like the USART)
+	comm_link_t *link; //Gets the received bytes
+	uint8_t tx_buf[COMM_WINDOW * COMM_FRAME_MAX];
+	uint32_t slowdown; //Real ms per ms of the link clock (time_ms, wait), so that the latency of the pty and the scheduler is small against COMM_TIMEOUT_MS
+} host_t;
+
+static sim_t sim;
+static host_t host;
+static comm_link_t comm; //Link under test
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void write_all(int fd, const uint8_t *data, int len)
+{
+	while(len > 0)
+	{
+		int n = write(fd, data, len);
+
+		if(n <= 0)
+		{
+			perror("write");
+			exit(2);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+// Simulated subcontroller
+// ----------------------------------------------------------------------------
+
+//Next received byte, -1 if the simulation is stopped
+static int sim_getc(sim_t *s)
+{
+	uint8_t c;
+
+	for(;;)
+	{
+		struct pollfd p = {s->fd, POLLIN, 0};
+
+		if(s->stop)
+			return -1;
+		if((poll(&p, 1, 10) == 1) && (read(s->fd, &c, 1) == 1))
+			return c;
+	}
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief sim_answer
+///		Sends the answer to a package (with the next fault)
+
+static void sim_answer(sim_t *s, uint8_t start, uint8_t seq, uint8_t reg, uint8_t batch, const uint8_t *data)
+{
+	uint8_t buf[COMM_FRAME_MAX];
+	uint8_t fault = SIM_OK;
+	uint16_t chk = 0;
+	int len = 0;
+
+	if(s->faults > 0)
+	{
+		fault = s->fault[0];
+		memmove(&s->fault[0], &s->fault[1], --s->faults);
+	}
+	if(fault == SIM_DROP)
+		return;
+	if(fault == SIM_SEQ)
+		seq += COMM_WINDOW; //Same slot of the window, not outstanding
+	if((fault == SIM_SHORT) && (batch & COMM_BATCH_WRITE) && ((batch & COMM_BATCH) > 0))
+		batch --;
+
+	buf[len++] = start;
+	if(start == COMM_START_SEQ)
+		buf[len++] = seq;
+	buf[len++] = reg;
+	buf[len++] = batch;
+	if(batch & COMM_BATCH_WRITE)
+		for(int i = 0; i < (batch & COMM_BATCH); i++)
+			buf[len++] = data[i];
+
+	for(int i = 0; i < len; i++)
+		chk += buf[i];
+	if(fault == SIM_CHECKSUM)
+		chk ^= 0x100;
+	buf[len++] = chk >> 8;
+	buf[len++] = chk & 0xff;
+
+	if(fault == SIM_TRUNCATE)
+		len -= 3;
+	if((fault == SIM_HOLD) || (fault == SIM_LATE))
+	{
+		memcpy(s->held, buf, len);
+		s->held_len = len;
+		s->held_fault = fault;
+	}
+	else
+		write_all(s->fd, buf, len);
+}
+
+/////////////////////////////////////////////////////////////////
+/// \brief sim_run
+///		Thread of the subcontroller: Receives the packages, executes
+///		them on the register map and answers them
+
+static void *sim_run(void *arg)
+{
+	sim_t *s = arg;
+	int c;
+
+	while((c = sim_getc(s)) >= 0)
+	{
+		uint8_t seq = 0, reg, batch, n;
+		uint8_t data[COMM_BATCH];
+		uint16_t sum = c, chk;
+
+		if((c != COMM_START) && ((c != COMM_START_SEQ) || s->legacy))
+			continue; //Between the packages (an old slave does not know 0xAC)
+
+		if(c == COMM_START_SEQ)
+			sum += (seq = sim_getc(s));
+		sum += (reg = sim_getc(s));
+		sum += (batch = sim_getc(s));
+		n = batch & COMM_BATCH;
+		if(batch & COMM_BATCH_WRITE)
+			for(int i = 0; i < n; i++)
+				sum += (data[i] = sim_getc(s));
+		chk = sim_getc(s) << 8;
+		chk |= sim_getc(s);
+		if(s->stop)
+			break;
+
+		pthread_mutex_lock(&s->lock);
+		s->requests ++;
+
+		uint8_t prev[COMM_FRAME_MAX], prev_len = s->held_len, prev_fault = s->held_fault; //Held answer of an earlier request
+		memcpy(prev, s->held, prev_len);
+		s->held_len = 0;
+		if(prev_fault == SIM_LATE)
+			write_all(s->fd, prev, prev_len);
+
+		if((chk != sum) || (reg + n > COMM_REGISTERS_CNT))
+		{
+			s->bad ++;
+			sim_answer(s, c, seq, 255, 0, NULL);
+		}
+		else if(batch & COMM_BATCH_WRITE)
+		{
+			memcpy(&s->reg[reg], data, n);
+			sim_answer(s, c, seq, reg, n, NULL);
+		}
+		else
+			sim_answer(s, c, seq, reg, n | COMM_BATCH_WRITE, &s->reg[reg]);
+
+		if(prev_fault == SIM_HOLD)
+			write_all(s->fd, prev, prev_len);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+// Link side (comm_port_t of the pty)
+// ----------------------------------------------------------------------------
+
+static uint8_t *host_txBuffer(void *ctx)
+{
+	return ((host_t *) ctx)->tx_buf;
+}
+
+static void host_send(void *ctx, uint16_t len)
+{
+	host_t *h = ctx;
+
+	write_all(h->fd, h->tx_buf, len);
+}
+
+static void host_wait(void *ctx, uint16_t timeout_ms)
+{
+	host_t *h = ctx;
+	uint64_t t_end = now_ms() + timeout_ms * h->slowdown;
+	uint8_t done = 0;
+
+	while(!done)
+	{
+		struct pollfd p = {h->fd, POLLIN, 0};
+		int64_t left = t_end - now_ms();
+		uint8_t buf[64];
+		int n;
+
+		if((left <= 0) || (poll(&p, 1, left) != 1) || ((n = read(h->fd, buf, sizeof(buf))) <= 0))
+			break;
+
+		for(int i = 0; i < n; i++) //Like the receive interrupt: All received bytes are passed on
+			done |= comm_link_rxByte(h->link, buf[i]);
+	}
+}
+
+static uint32_t host_time(void *ctx)
+{
+	return now_ms() / ((host_t *) ctx)->slowdown;
+}
+
+static const comm_port_t port = {&host, host_txBuffer, host_send, host_wait, host_time};
+
+//Passes the bytes that are still on the way to the link (answers after the timeout)
+static void host_drain(void)
+{
+	host_wait(&host, 2 * COMM_TIMEOUT_MS);
+	comm_link_abort(&comm);
+}
+
+//Starts the next test: Register map, mode, faults of the next answers (terminated by -1)
+static void sim_reset(int legacy, ...)
+{
+	va_list ap;
+	int f;
+
+	host_drain();
+
+	pthread_mutex_lock(&sim.lock);
+	sim.legacy = legacy;
+	for(int i = 0; i < COMM_REGISTERS_CNT; i++)
+		sim.reg[i] = i * 7 + 3;
+	sim.faults = 0;
+	sim.held_len = 0;
+	sim.held_fault = SIM_OK;
+	va_start(ap, legacy);
+	while(((f = va_arg(ap, int)) >= 0) && (sim.faults < SIM_FAULTS))
+		sim.fault[sim.faults++] = f;
+	va_end(ap);
+	sim.requests = 0;
+	sim.bad = 0;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+// Tests
+// ----------------------------------------------------------------------------
+
+//Messages of a control cycle: Write the motor speeds, read the encoders and the status
+static comm_msg_t msg_speed, msg_enc, msg_status;
+static uint8_t speed[3] = {20, 236, 0};
+static uint8_t rx_enc[8], rx_status;
+static comm_xfer_t xfer[3];
+
+static void cycle_init(void)
+{
+	msg_speed.reg = COMM_MOT_SPEED_L_TO;
+	msg_speed.batch = sizeof(speed);
+	msg_speed.batch_write = 1;
+	msg_speed.data = speed;
+
+	msg_enc.reg = COMM_MOT_ENC_L_LSB_0;
+	msg_enc.batch = sizeof(rx_enc);
+	msg_enc.batch_write = 0;
+
+	msg_status.reg = COMM_SYSTEMSTATUS;
+	msg_status.batch = 1;
+	msg_status.batch_write = 0;
+
+	xfer[0].msg = &msg_speed;
+	xfer[0].rx = NULL;
+	xfer[1].msg = &msg_enc;
+	xfer[1].rx = rx_enc;
+	xfer[2].msg = &msg_status;
+	xfer[2].rx = &rx_status;
+
+	memset(rx_enc, 0, sizeof(rx_enc));
+	rx_status = 0;
+}
+
+//Checks the result of a control cycle in which every message was answered
+static void cycle_check(const char *name)
+{
+	for(int i = 0; i < 3; i++)
+		CHECK(xfer[i].ok, "%s: message %i not answered", name, i);
+	for(int i = 0; i < (int) sizeof(rx_enc); i++)
+		CHECK(rx_enc[i] == sim.reg[COMM_MOT_ENC_L_LSB_0 + i], "%s: encoder byte %i: %i instead of %i", name, i, rx_enc[i], sim.reg[COMM_MOT_ENC_L_LSB_0 + i]);
+	CHECK(rx_status == sim.reg[COMM_SYSTEMSTATUS], "%s: status %i", name, rx_status);
+	CHECK(memcmp(&sim.reg[COMM_MOT_SPEED_L_TO], speed, sizeof(speed)) == 0, "%s: speeds not written", name);
+	CHECK(sim.bad == 0, "%s: %u broken packages", name, sim.bad);
+}
+
+//Slave without the pipelined protocol: The probe fails, the original protocol still works
+static void test_legacy(void)
+{
+	sim_reset(1, -1);
+	CHECK(comm_link_probe(&comm, &port) == 0, "old slave detected as pipelined");
+	CHECK(sim.requests == 0, "old slave answered 0xAC");
+
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 0, xfer, 3, 3) == 3, "legacy cycle");
+	CHECK(sim.requests == 3, "%u requests instead of 3", sim.requests);
+	cycle_check("legacy");
+}
+
+//Pipelined protocol without faults
+static void test_pipelined(void)
+{
+	sim_reset(0, -1);
+	CHECK(comm_link_probe(&comm, &port) == 1, "pipelined slave not detected");
+
+	for(int i = 0; i < 100; i++)
+	{
+		cycle_init();
+		speed[0] = i;
+		CHECK(comm_link_transfer(&comm, &port, 1, xfer, 3, 3) == 3, "cycle %i", i);
+		cycle_check("pipelined");
+	}
+	CHECK(sim.requests == 1 + 100 * 3, "%u requests", sim.requests);
+}
+
+//Answer with the sequence number of another request: Ignored, the request is sent again
+static void test_seqMismatch(void)
+{
+	sim_reset(0, SIM_OK, SIM_SEQ, -1);
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 1, xfer, 3, 3) == 3, "not repeated");
+	CHECK(sim.requests == 4, "%u requests instead of 4", sim.requests);
+	cycle_check("seq");
+
+	sim_reset(0, SIM_SEQ, -1);
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 1, xfer, 1, 1) == 0, "answer with wrong sequence number accepted");
+	CHECK(!xfer[0].ok, "ok set");
+}
+
+//Answer with checksum error: The request fails and is sent again (legacy and pipelined)
+static void test_checksum(void)
+{
+	for(uint8_t pipelined = 0; pipelined <= 1; pipelined++)
+	{
+		sim_reset(!pipelined, SIM_CHECKSUM, -1);
+		cycle_init();
+		CHECK(comm_link_transfer(&comm, &port, pipelined, xfer, 3, 2) == 3, "not repeated (pipelined %i)", pipelined);
+		CHECK(sim.requests == 4, "%u requests instead of 4", sim.requests);
+		cycle_check("checksum");
+
+		sim_reset(!pipelined, SIM_CHECKSUM, -1);
+		cycle_init();
+		CHECK(comm_link_transfer(&comm, &port, pipelined, &xfer[1], 1, 1) == 0, "broken answer accepted (pipelined %i)", pipelined);
+	}
+}
+
+//Lost answers: Sent again up to max_tries times
+static void test_retry(void)
+{
+	sim_reset(0, SIM_DROP, SIM_DROP, -1);
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 1, xfer, 1, 3) == 1, "third try not answered");
+	CHECK(sim.requests == 3, "%u requests instead of 3", sim.requests);
+
+	sim_reset(0, SIM_DROP, SIM_DROP, SIM_DROP, -1);
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 1, xfer, 1, 3) == 0, "no answer, but ok");
+	CHECK(sim.requests == 3, "%u requests instead of 3", sim.requests);
+
+	sim_reset(1, SIM_DROP, SIM_OK, SIM_DROP, -1); //Legacy: One message after the other
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 0, xfer, 3, 2) == 3, "legacy retry");
+	CHECK(sim.requests == 5, "%u requests instead of 5", sim.requests);
+	cycle_check("retry");
+}
+
+//Truncated answer: After the timeout the parser has to wait for the next start byte again
+static void test_truncated(void)
+{
+	for(uint8_t pipelined = 0; pipelined <= 1; pipelined++)
+	{
+		sim_reset(!pipelined, SIM_TRUNCATE, -1);
+		cycle_init();
+		CHECK(comm_link_transfer(&comm, &port, pipelined, &xfer[1], 1, 2) == 1, "answer after a truncated one lost (pipelined %i)", pipelined);
+		CHECK(sim.requests == 2, "%u requests instead of 2", sim.requests);
+		for(int i = 0; i < (int) sizeof(rx_enc); i++)
+			CHECK(rx_enc[i] == sim.reg[COMM_MOT_ENC_L_LSB_0 + i], "encoder byte %i: %i instead of %i", i, rx_enc[i], sim.reg[COMM_MOT_ENC_L_LSB_0 + i]);
+	}
+}
+
+//Answer with less data than requested: The request fails and is sent again (legacy and pipelined)
+static void test_short(void)
+{
+	for(uint8_t pipelined = 0; pipelined <= 1; pipelined++)
+	{
+		sim_reset(!pipelined, SIM_SHORT, -1);
+		cycle_init();
+		CHECK(comm_link_transfer(&comm, &port, pipelined, &xfer[1], 1, 1) == 0, "short answer accepted (pipelined %i)", pipelined);
+
+		sim_reset(!pipelined, SIM_SHORT, -1);
+		cycle_init();
+		CHECK(comm_link_transfer(&comm, &port, pipelined, &xfer[1], 1, 2) == 1, "not repeated (pipelined %i)", pipelined);
+		CHECK(sim.requests == 2, "%u requests instead of 2", sim.requests);
+		for(int i = 0; i < (int) sizeof(rx_enc); i++)
+			CHECK(rx_enc[i] == sim.reg[COMM_MOT_ENC_L_LSB_0 + i], "encoder byte %i: %i instead of %i", i, rx_enc[i], sim.reg[COMM_MOT_ENC_L_LSB_0 + i]);
+	}
+}
+
+//Window of 2: Both requests are outstanding at once, the answers are assigned by their sequence number
+static void test_window(void)
+{
+	sim_reset(0, SIM_HOLD, -1); //Answer to the speeds after the one to the encoders
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 1, xfer, 2, 1) == 2, "answers in the wrong order not assigned");
+	CHECK(sim.requests == 2, "%u requests instead of 2", sim.requests);
+	CHECK(xfer[0].ok && xfer[1].ok, "not ok");
+	for(int i = 0; i < (int) sizeof(rx_enc); i++)
+		CHECK(rx_enc[i] == sim.reg[COMM_MOT_ENC_L_LSB_0 + i], "encoder byte %i: %i instead of %i", i, rx_enc[i], sim.reg[COMM_MOT_ENC_L_LSB_0 + i]);
+
+	sim_reset(1, SIM_HOLD, -1); //Original protocol: The encoders are only requested after the answer to the speeds
+	cycle_init();
+	CHECK(comm_link_transfer(&comm, &port, 0, xfer, 2, 1) == 1, "legacy: more than one request outstanding");
+	CHECK(!xfer[0].ok && xfer[1].ok, "legacy: wrong request answered");
+}
+
+//Answer after the timeout: The request is sent again, the late answer is ignored
+static void test_timeout(void)
+{
+	uint32_t t;
+
+	sim_reset(0, SIM_LATE, -1);
+	cycle_init();
+	t = host_time(&host);
+	CHECK(comm_link_transfer(&comm, &port, 1, &xfer[1], 1, 2) == 1, "not answered after the timeout");
+	t = host_time(&host) - t;
+	CHECK(t >= COMM_TIMEOUT_MS, "retry after %ums (timeout: %ums)", t, COMM_TIMEOUT_MS);
+	CHECK(sim.requests == 2, "%u requests instead of 2", sim.requests);
+
+	sim_reset(0, SIM_DROP, SIM_DROP, SIM_DROP, -1); //No answer at all: max_tries timeouts, the task sleeps meanwhile
+	cycle_init();
+	t = host_time(&host);
+	CHECK(comm_link_transfer(&comm, &port, 1, xfer, 1, 3) == 0, "ok without answer");
+	t = host_time(&host) - t;
+	CHECK(sim.requests == 3, "%u requests instead of 3", sim.requests);
+	CHECK((t >= 3 * COMM_TIMEOUT_MS) && (t < 2 * 3 * COMM_TIMEOUT_MS), "3 timeouts took %ums", t); //Upper limit: Only to catch a hang
+}
+
+int main(void)
+{
+	struct termios tio;
+	pthread_t thread;
+
+	sim.fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if((sim.fd < 0) || (grantpt(sim.fd) != 0) || (unlockpt(sim.fd) != 0) ||
+	   ((host.fd = open(ptsname(sim.fd), O_RDWR | O_NOCTTY)) < 0))
+	{
+		perror("pty");
+		return 2;
+	}
+	tcgetattr(host.fd, &tio); //Binary data: No echo, no line editing, no translation
+	cfmakeraw(&tio);
+	tcsetattr(host.fd, TCSANOW, &tio);
+
+	host.link = &comm;
+	host.slowdown = 10;
+	comm_link_abort(&comm);
+	pthread_mutex_init(&sim.lock, NULL);
+	pthread_create(&thread, NULL, sim_run, &sim);
+
+	test_legacy();
+	test_pipelined();
+	test_seqMismatch();
+	test_checksum();
+	test_retry();
+	test_truncated();
+	test_short();
+	test_window();
+	test_timeout();
+
+	sim.stop = 1;
+	pthread_join(thread, NULL);
+
+	printf("subctrl_sim: %s\n", failed ? "FAILED" : "ok");
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+//////////////////////////////////////////////////////////////////////////////////////
+/// txring_test.c - Test of the transmit ring with a simulated drain (runs on the PC)
+///
+/// The producer puts blocks of random length, the simulated drain takes the data
+/// out with txring_get in random partial reads, like txmux_frame copies up to one
+/// payload of a channel into the frame the DMA sends. Every byte is the low byte
+/// of its absolute position in the stream, so the drain can check that it gets
+/// every byte of the accepted blocks once and in order.
+///
+/// Build and run: make -C tools test
+//////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "txring.h"
+#include "check.h"
+
+#define SIZE	64
+
+static u_int32_t put_pos; //Absolute position of the next byte the producer puts
+static u_int32_t get_pos; //Absolute position of the next byte the drain expects
+
+//Puts a block of len bytes (continuing the stream if it is accepted)
+static u_int16_t put(txring_t *ring, u_int16_t len)
+{
+	u_int8_t block[SIZE + 1];
+	u_int16_t n;
+
+	for(u_int16_t i = 0; i < len; i++)
+		block[i] = (put_pos + i) & 0xff;
+
+	n = txring_put_block(ring, block, len);
+	if(n == len)
+		put_pos += len;
+
+	return n;
+}
+
+//Copies up to max bytes out of the ring (like one frame of txmux_frame) and checks them
+static u_int16_t drain(txring_t *ring, u_int16_t max)
+{
+	u_int8_t dst[SIZE + 1];
+	u_int16_t used = txring_used(ring);
+	u_int16_t n;
+
+	memset(dst, 0xee, sizeof(dst));
+	n = txring_get(ring, dst, max);
+
+	CHECK(n == ((used < max) ? used : max), "got %i bytes (used %i, max %i)", n, used, max);
+	CHECK(dst[n] == 0xee, "wrote behind %i bytes", n);
+	for(u_int16_t i = 0; i < n; i++)
+		CHECK(dst[i] == ((get_pos + i) & 0xff), "byte %u: %i instead of %i", get_pos + i, dst[i], (get_pos + i) & 0xff);
+	get_pos += n;
+
+	return n;
+}
+
+static void reset(txring_t *ring, u_int8_t *buf, u_int32_t start)
+{
+	txring_init(ring, buf, SIZE);
+	ring->head = ring->tail = start;
+	put_pos = get_pos = 0;
+}
+
+//Blocks across the end of the buffer
+static void test_wrap(void)
+{
+	u_int8_t buf[SIZE];
+	txring_t ring;
+
+	reset(&ring, buf, 0);
+
+	CHECK(put(&ring, SIZE - 10) == SIZE - 10, "first block");
+	CHECK(drain(&ring, SIZE) == SIZE - 10, "first block drained");
+	CHECK(put(&ring, 20) == 20, "block across the end");
+	CHECK(ring.head % SIZE == 10, "head at %u", ring.head % SIZE);
+	for(int i = 0; i < 10; i++)
+		CHECK(buf[i] == SIZE + i, "second part not at the beginning of the buffer (%i: %i)", i, buf[i]);
+	CHECK(drain(&ring, SIZE) == 20, "block across the end drained");
+
+	CHECK(put(&ring, SIZE) == SIZE, "block of the whole size");
+	CHECK(txring_free(&ring) == 0, "free %i", txring_free(&ring));
+	CHECK(drain(&ring, SIZE) == SIZE, "block of the whole size drained");
+	CHECK(txring_used(&ring) == 0, "used %i", txring_used(&ring));
+}
+
+//A block that does not fit is dropped completely, the next one that fits is put
+static void test_drop(void)
+{
+	u_int8_t buf[SIZE];
+	txring_t ring;
+
+	reset(&ring, buf, 0);
+
+	CHECK(put(&ring, 40) == 40, "first block");
+	CHECK(put(&ring, 30) == 0, "block too long for the free space put");
+	CHECK(ring.dropped == 1, "dropped %u", ring.dropped);
+	CHECK(txring_used(&ring) == 40, "dropped block partially put (used %i)", txring_used(&ring));
+	CHECK(put(&ring, SIZE - 40) == SIZE - 40, "block that fits exactly");
+	CHECK(put(&ring, 1) == 0, "byte put into the full ring");
+	CHECK(put(&ring, SIZE + 1) == 0, "block longer than the ring put");
+	CHECK(ring.dropped == 3, "dropped %u", ring.dropped);
+
+	CHECK(drain(&ring, SIZE) == SIZE, "drained");
+}
+
+//Random blocks, drained in random partial reads, also across the overflow of the absolute positions
+static void test_stream(u_int32_t start)
+{
+	u_int8_t buf[SIZE];
+	txring_t ring;
+	u_int32_t puts = 0;
+
+	reset(&ring, buf, start);
+
+	for(int i = 0; i < 100000; i++)
+	{
+		u_int16_t len = 1 + rand() % (SIZE / 2);
+		u_int16_t room = txring_free(&ring);
+		u_int16_t n = put(&ring, len);
+
+		puts ++;
+		CHECK(n == ((len <= room) ? len : 0), "put %i of %i bytes (free %i)", n, len, room);
+		drain(&ring, rand() % (SIZE / 2));
+	}
+	while(drain(&ring, 7) > 0);
+
+	CHECK(get_pos == put_pos, "drained %u of %u bytes", get_pos, put_pos);
+	CHECK(ring.dropped > 0, "nothing dropped (test too weak)");
+	CHECK(ring.dropped < puts, "everything dropped");
+}
+
+int main(void)
+{
+	srand(1);
+
+	test_wrap();
+	test_drop();
+	test_stream(0);
+	test_stream(0xffffffff - 1000);
+
+	printf("txring_test: %s\n", failed ? "FAILED" : "ok");
+
+	return failed ? 1 : 0;
+}